@@ -33,8 +33,12 @@
 #ifndef IPMI_AUTH_H
 #define IPMI_AUTH_H
 
-uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len);
-uint8_t * ipmi_auth_md5(struct ipmi_session * s, uint8_t * data, int data_len);
-uint8_t * ipmi_auth_special(struct ipmi_session * s);
+#include <sys/uio.h>
+
+uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len, uint8_t * md);
+uint8_t * ipmi_auth_md5(struct ipmi_session * s, uint8_t * data, int data_len, uint8_t * md);
+uint8_t * ipmi_auth_md2_iov(struct ipmi_session * s, const struct iovec * iov, int iovcnt, uint8_t * md);
+uint8_t * ipmi_auth_md5_iov(struct ipmi_session * s, const struct iovec * iov, int iovcnt, uint8_t * md);
+uint8_t * ipmi_auth_special(struct ipmi_session * s, uint8_t * md);
 
 #endif /*IPMI_AUTH_H*/
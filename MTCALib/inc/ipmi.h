@@ -44,6 +44,8 @@
 #endif
 
 #define IPMI_BUF_SIZE 1024
+#define IPMI_RQ_SEQ_MAX 64		/* rq_seq is 6 bits */
+#define IPMI_MAX_FRAME_SIZE 288	/* RMCP, session header, authcode and a 255 byte message */
 
 #if HAVE_PRAGMA_PACK
 #define ATTRIBUTE_PACKING
@@ -99,26 +101,44 @@ struct ipmi_rq {
 		uint16_t data_len;
 		uint8_t *data;
 	} msg;
+	/* bridge target of this request, the interface one if target_addr is 0 */
+	uint8_t target_addr;
+	uint8_t target_channel;
+	uint8_t transit_addr;
+	uint8_t transit_channel;
+	/* sent after msg.data without being copied: must stay valid until the request completes */
+	uint8_t *payload;
+	uint16_t payload_len;
+	/* engine: sent a single time, the caller resends it in its own order */
+	uint8_t once;
+	/* engine: sent a single time, its answer awaited for the whole session timeout */
+	uint8_t no_retry;
 };
 
 struct ipmi_rq_entry {
 	struct ipmi_rq req;
 	struct ipmi_intf *intf;
 	uint8_t rq_seq;
-	uint8_t *msg_data;
-	int msg_len;
+	uint8_t msg_data[IPMI_MAX_FRAME_SIZE];	/* last frame sent, built in place */
+	int msg_len;			/* up to the request data, the checksums follow */
+	int trailer_len;
 	int bridging_level;
-	struct ipmi_rq_entry *next;
+	int retried;			/* sent again with the same rq_seq */
+	int queued;			/* waiting for the next flush() */
+	uint64_t sent;			/* us, monotonic */
+	int active;			/* waiting for its response */
 };
 
 struct ipmi_rs {
 	uint8_t ccode;
-	uint8_t data[IPMI_BUF_SIZE];
+	uint8_t buf[IPMI_BUF_SIZE];	/* datagram as received */
 
 	/*
-	 * Looks like this is the length of the entire packet, including the RMCP
-	 * stuff, then modified to be the length of the extra IPMI message data
+	 * The whole datagram when received, then narrowed in place to the
+	 * response data of the innermost message: nothing is moved or cleared,
+	 * bytes past data_len are not zero.
 	 */
+	uint8_t * data;
 	int data_len;
 
 	struct {
@@ -0,0 +1,69 @@
+#ifndef IPMI_ENGINE_H
+#define IPMI_ENGINE_H
+
+#include <ipmi.h>
+#include <ipmi_intf.h>
+#include <ipmi_timer.h>
+
+/*
+ * Event driven transport: one thread keeps any number of open LAN sessions
+ * progressing. Requests are queued with a completion handler, sockets are
+ * watched with epoll and every outstanding request is retransmitted on its
+ * own timer. All timers live in one timer wheel, so ipmi_engine_run() sleeps
+ * exactly until the first one is due. Nothing blocks except ipmi_engine_run().
+ */
+
+#define IPMI_ENGINE_MAX_EVENTS		64
+#define IPMI_ENGINE_MAX_OUTSTANDING	60	/* per session, below the 64 rq_seq values */
+#define IPMI_ENGINE_MAX_DATA		80	/* request data bytes kept for retransmission */
+
+struct ipmi_engine;
+
+/* Called once per request: with its response, or with NULL when every try timed out */
+typedef void (*ipmi_rsp_handler)(struct ipmi_intf * intf, struct ipmi_rs * rsp, void * arg);
+typedef void (*ipmi_timer_handler)(void * arg);
+/* Called once the handshake of ipmi_engine_attach_async() ended: rc 0 if the session is active, -1 if not */
+typedef void (*ipmi_open_handler)(struct ipmi_intf * intf, int rc, void * arg);
+/* Called once ipmi_engine_close() detached the session: it can be freed, its close() sends nothing */
+typedef void (*ipmi_close_handler)(struct ipmi_intf * intf, void * arg);
+
+struct ipmi_engine * ipmi_engine_create(void);
+void ipmi_engine_free(struct ipmi_engine * e);
+
+/*
+ * Open the session if needed and start watching it; detach drops its pending
+ * requests. An attached session idle for half its inactivity timeout is sent
+ * a keepalive, so the BMC never closes it while waiting.
+ */
+int ipmi_engine_attach(struct ipmi_engine * e, struct ipmi_intf * intf);
+
+/*
+ * Attach a session not opened yet, and activate it from ipmi_engine_run():
+ * the handshakes of several sessions go on at the same time. Requests
+ * queued meanwhile are sent once it is active, or fail without response
+ * if it cannot be; handler is called first.
+ */
+int ipmi_engine_attach_async(struct ipmi_engine * e, struct ipmi_intf * intf, ipmi_open_handler handler, void * arg);
+void ipmi_engine_detach(struct ipmi_engine * e, struct ipmi_intf * intf);
+
+/*
+ * Send Close Session behind the requests already queued, and detach the
+ * session from ipmi_engine_run() once it is answered or timed out: a
+ * silent BMC never blocks the other sessions.
+ */
+int ipmi_engine_close(struct ipmi_engine * e, struct ipmi_intf * intf, ipmi_close_handler handler, void * arg);
+
+/* Queue a request (req->msg.data is copied). Returns 0, or -1 on error */
+int ipmi_engine_send(struct ipmi_engine * e, struct ipmi_intf * intf, struct ipmi_rq * req, ipmi_rsp_handler handler, void * arg);
+
+/* Call handler(arg) once, delay_us from now. t belongs to the caller; arming it again moves it */
+int ipmi_engine_timer(struct ipmi_engine * e, struct ipmi_timer * t, unsigned long delay_us, ipmi_timer_handler handler, void * arg);
+void ipmi_engine_timer_cancel(struct ipmi_engine * e, struct ipmi_timer * t);
+
+/*
+ * Wait up to timeout_us for I/O or a timer, and run every handler due.
+ * Returns the number of requests and timers still pending, -1 on error.
+ */
+int ipmi_engine_run(struct ipmi_engine * e, unsigned long timeout_us);
+
+#endif /* IPMI_ENGINE_H */
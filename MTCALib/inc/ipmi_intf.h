@@ -38,6 +38,14 @@
 
 #include <sys/types.h>
 #include <arpa/inet.h>
+
+#ifdef HAVE_CRYPTO_MD5
+# include <openssl/md5.h>
+typedef MD5_CTX ipmi_md5_ctx;
+#else
+# include "md5.h"
+typedef md5_state_t ipmi_md5_ctx;
+#endif
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -83,7 +91,20 @@ struct ipmi_session {
 
 	uint32_t session_id;								//Used
 	uint32_t in_seq;									//Used
-	uint32_t timeout;									//Used: ipmi lan timeout
+	uint32_t timeout;									//Used: ipmi lan timeout (s)
+	uint32_t inactivity;								//Used: the BMC closes the session when idle that long (s)
+	uint32_t srtt;										//Used: smoothed round trip time (us)
+	uint32_t rttvar;									//Used: round trip time variation (us)
+	uint32_t rto;										//Used: retransmission timeout (us)
+
+	ipmi_md5_ctx md5_prefix;							//Used: MD5 state after password + session_id
+	uint32_t md5_prefix_id;								//Used: session_id it was computed for
+	int md5_prefix_valid;								//Used
+
+	int hs_state;										//Used: handshake step (lan.c)
+	int hs_tries;										//Used: failed Get Channel Auth Capabilities
+	int hs_cached;										//Used: capabilities taken from the cache
+	uint8_t hs_data[22];								//Used: request data of the handshake step
 
 	struct sockaddr_in addr;							//Used: connection information
 
@@ -107,6 +128,86 @@ struct ipmi_intf_support {
 	int supported;
 };
 
+/*
+ * handshake() drives the session activation one request at a time, on a
+ * session connect() opened without activating it: it returns
+ * IPMI_HANDSHAKE_SEND with the next request in req, IPMI_HANDSHAKE_RETRY
+ * when req is to be sent after one RTO, 0 once the session is active and
+ * -1 on failure.
+ */
+#define IPMI_HANDSHAKE_SEND	1
+#define IPMI_HANDSHAKE_RETRY	2
+
+#define IPMI_LAN_RX_BATCH	16	/* datagrams read by one recvmmsg() */
+#define IPMI_LAN_RX_RING	IPMI_RQ_SEQ_MAX	/* responses buffered by session: one per request in flight */
+#define IPMI_LAN_TEMPLATES	16
+#define IPMI_LAN_TEMPLATE_SIZE	64
+
+/*
+ * Prebuilt start of the request frames sent to one target, up to the
+ * rq_seq of the target message. Sending a request copies it, patches the
+ * session seq, message length and rq_seq bytes, and derives the
+ * checksums from the ones of an empty request.
+ */
+struct ipmi_lan_template {
+	int valid;
+	/* what the header depends on */
+	uint32_t session_id;
+	uint8_t active;
+	uint8_t bridge_possible;
+	uint8_t authtype;
+	uint8_t netfn_lun;
+	uint8_t target_addr;
+	uint8_t target_channel;
+	uint8_t transit_addr;
+	uint8_t transit_channel;
+
+	uint8_t hdr[IPMI_LAN_TEMPLATE_SIZE];
+	int hdr_len;
+	int ap;					/* authcode offset, 0 if none */
+	int mp;					/* message offset, the length is right before */
+	uint8_t msg_len;			/* message length without request data */
+	int bridging_level;
+	int seq_off[2];				/* rq_seq of the Send Message layers */
+	uint8_t csum[3];			/* trailing checksums of an empty request with rq_seq 0 */
+};
+
+/*
+ * Unconnected UDP socket shared by several LAN sessions: each datagram is
+ * routed to the receive ring of its session by source address and session
+ * ID, and the queued frames of all of them leave in one sendmmsg().
+ */
+struct ipmi_lan_socket {
+	int fd;
+	struct ipmi_intf * intfs;		/* opened sessions */
+	unsigned long rx_dropped;		/* datagrams dropped, their session's ring full */
+	uint8_t rx[IPMI_LAN_RX_BATCH][IPMI_BUF_SIZE];
+};
+
+#define IPMI_LAN_CAPS_CACHE	16	/* BMCs whose authentication capabilities are remembered */
+
+/*
+ * Authentication capabilities of the BMCs already reached, with their
+ * round trip estimate: the next session to one of them skips Get Channel
+ * Authentication Capabilities, and starts with a real RTO. Owned by the
+ * caller, shared by the sessions it drives from one thread.
+ */
+struct ipmi_lan_caps {
+	struct sockaddr_in addr;
+	uint8_t privlvl;		/* requested, the answer depends on it */
+	uint8_t authtypes;		/* supported authentication types, bit per type */
+	uint8_t authstatus;
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+};
+
+struct ipmi_lan_caps_cache {
+	struct ipmi_lan_caps entries[IPMI_LAN_CAPS_CACHE];
+	int count;
+	int next;			/* next entry replaced once full */
+};
+
 typedef struct ipmi_intf {
 	char name[16];
 	char desc[128];
@@ -122,10 +223,40 @@ typedef struct ipmi_intf {
 	uint32_t transit_addr;					//Used
 	uint8_t transit_channel;				//Used
 
+	/*
+	 * Per-session transport state: every session opened with
+	 * open_lan_session() owns its own copy, so several sessions
+	 * can be driven at the same time.
+	 */
+	struct ipmi_rq_entry req_entries[IPMI_RQ_SEQ_MAX];	//Used: outstanding requests, by rq_seq
+	struct ipmi_lan_template templates[IPMI_LAN_TEMPLATES];	//Used: frame headers by target
+	int next_template;						//Used: next template replaced
+	uint8_t bridge_possible;				//Used: session is active, bridging allowed
+	int curr_seq;							//Used: last rq_seq sent
+	struct ipmi_rs rsp[IPMI_LAN_RX_RING];	//Used: receive ring, refilled when read out
+	int rx_next;							//Used: next response in the ring
+	int rx_count;							//Used: responses in the ring
+	int tx_batch;							//Used: send() and send_seq() only queue frames for flush()
+	uint8_t tx_queue[IPMI_RQ_SEQ_MAX];		//Used: rq_seq of the queued frames
+	int tx_count;							//Used
+	struct ipmi_lan_socket * sock;			//Used: shared socket, NULL: own connected socket
+	struct ipmi_intf * sock_next;			//Used: next session on the shared socket
+	struct ipmi_lan_caps_cache * caps;		//Used: shared capabilities cache, NULL: none
+	void * engine;							//Used: ipmi_engine state, when attached
+
 	int (*setup)(struct ipmi_intf * intf);
 	int (*open)(struct ipmi_intf * intf);
+	int (*connect)(struct ipmi_intf * intf);
+	int (*handshake)(struct ipmi_intf * intf, struct ipmi_rs * rsp, struct ipmi_rq * req);
+	int (*close_req)(struct ipmi_intf * intf, struct ipmi_rq * req);	/* Close Session to send, -1 if the session is not active */
 	void (*close)(struct ipmi_intf * intf);
 	struct ipmi_rs *(*sendrecv)(struct ipmi_intf * intf, struct ipmi_rq * req);
+	int (*send)(struct ipmi_intf * intf, struct ipmi_rq * req);
+	struct ipmi_rs *(*recv)(struct ipmi_intf * intf, unsigned long timeout_us);
+	void (*cancel)(struct ipmi_intf * intf, uint8_t seq);
+	int (*send_seq)(struct ipmi_intf * intf, struct ipmi_rq * req, uint8_t seq, int retry);
+	int (*seq_taken)(struct ipmi_intf * intf, uint8_t seq);	/* the seq must not be given to send_seq(): another session may be answered with it */
+	int (*flush)(struct ipmi_intf * intf);
 	struct ipmi_rs *(*recv_sol)(struct ipmi_intf * intf);
 	int (*keepalive)(struct ipmi_intf * intf);
 } ipmi_intf;
@@ -0,0 +1,55 @@
+#ifndef IPMI_TIMER_H
+#define IPMI_TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with a 1 ms tick. Timers are embedded in the
+ * structure they belong to: arming and cancelling one is O(1) and never
+ * allocates. Level 0 holds the timers due in the current 64 ms block, one
+ * slot per tick; every further level covers 64 times more, and its slots
+ * are moved down one level as time reaches them.
+ */
+
+#define IPMI_TIMER_BITS		6
+#define IPMI_TIMER_SLOTS	(1 << IPMI_TIMER_BITS)
+#define IPMI_TIMER_LEVELS	4	/* 2^24 ms, about 4.6 hours; later timers wrap around */
+
+struct ipmi_timer {
+	uint64_t expires;			/* ms tick */
+	void (*handler)(void * arg);
+	void * arg;
+
+	/* wheel linkage: pprev is NULL while the timer is not armed */
+	struct ipmi_timer * next;
+	struct ipmi_timer ** pprev;
+	int level;				/* IPMI_TIMER_LEVELS: expired, not run yet */
+	int slot;
+};
+
+struct ipmi_timer_wheel {
+	uint64_t now;				/* first tick not expired yet */
+	int count;				/* armed timers */
+	uint64_t used[IPMI_TIMER_LEVELS];	/* bitmap of the non-empty slots */
+	struct ipmi_timer * slots[IPMI_TIMER_LEVELS][IPMI_TIMER_SLOTS];
+	struct ipmi_timer * due;		/* expired */
+};
+
+#define ipmi_timer_armed(t)	((t)->pprev != NULL)
+
+void ipmi_timer_init(struct ipmi_timer_wheel * w, uint64_t now);
+
+/* (Re)arm t to expire at the given tick; a tick already passed means the next one */
+void ipmi_timer_arm(struct ipmi_timer_wheel * w, struct ipmi_timer * t, uint64_t expires);
+void ipmi_timer_cancel(struct ipmi_timer_wheel * w, struct ipmi_timer * t);
+
+/* Tick of the first expiry, UINT64_MAX when nothing is armed */
+uint64_t ipmi_timer_next(struct ipmi_timer_wheel * w);
+
+/*
+ * Next timer expired at tick now, disarmed, or NULL. Run its handler
+ * before popping the next one: handlers may arm and cancel any timer.
+ */
+struct ipmi_timer * ipmi_timer_pop(struct ipmi_timer_wheel * w, uint64_t now);
+
+#endif /* IPMI_TIMER_H */
@@ -38,4 +38,9 @@
 
 extern struct ipmi_intf ipmi_lan_intf;
 
+struct ipmi_lan_socket * ipmi_lan_socket_open(void);
+void ipmi_lan_socket_close(struct ipmi_lan_socket * sock);
+struct ipmi_lan_caps_cache * ipmi_lan_caps_open(void);
+void ipmi_lan_caps_close(struct ipmi_lan_caps_cache * cache);
+
 #endif /*IPMI_LAN_H*/
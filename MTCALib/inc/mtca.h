@@ -3,6 +3,7 @@
 
 #include <ipmi.h>
 #include <ipmi_intf.h>
+#include <ipmi_engine.h>
 
 struct ipmi_intf * open_lan_session(unsigned char *hostname, 
 									unsigned char *username, 
@@ -12,8 +13,38 @@ struct ipmi_intf * open_lan_session(unsigned char *hostname,
 									unsigned char target_ch,
 									unsigned char transit_ch
 									);
+void close_lan_session(struct ipmi_intf *intf);
+
+/* One unconnected UDP socket for many sessions: share it before the session is opened, close it after them */
+struct ipmi_lan_socket * open_lan_socket(void);
+void close_lan_socket(struct ipmi_lan_socket *sock);
+int share_lan_socket(struct ipmi_intf *intf, struct ipmi_lan_socket *sock);
+
+/* Authentication capabilities and RTT of the MCHs already reached: share it before the session is opened, close it after them */
+struct ipmi_lan_caps_cache * open_lan_caps(void);
+void close_lan_caps(struct ipmi_lan_caps_cache *caps);
+int share_lan_caps(struct ipmi_intf *intf, struct ipmi_lan_caps_cache *caps);
 struct ipmi_rs * send_ipmi_cmd(struct ipmi_intf *intf, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len);
 
+/* Pipelined requests: send returns the rq_seq (0-63) or -1, recv returns the next response */
+int send_ipmi_cmd_async(struct ipmi_intf *intf, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len);
+struct ipmi_rs * recv_ipmi_rsp(struct ipmi_intf *intf, unsigned long timeout_us);
+void cancel_ipmi_cmd(struct ipmi_intf *intf, unsigned char seq);
+
+/* Same, bridged to target_addr on target_ch instead of the session target (one session, many controllers) */
+struct ipmi_rs * send_ipmi_cmd_to(struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len);
+int send_ipmi_cmd_async_to(struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len);
+
+/* Flags of queue_ipmi_cmd_payload() */
+#define IPMI_QUEUE_ONCE		0x01	/* sent only once: handler gets NULL after one timeout, so that the caller can resend it in order with others */
+#define IPMI_QUEUE_NO_RETRY	0x02	/* never sent again: handler gets NULL once the whole session timeout went by without answer (the session retries are left alone) */
+
+/*
+ * Event driven: the session must be attached to the engine, handler is called from ipmi_engine_run().
+ * data is copied, payload follows it and is sent from where it lies: it must stay valid until the handler is called.
+ */
+int queue_ipmi_cmd_payload(struct ipmi_engine *e, struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len, unsigned char *payload, unsigned int payload_len, unsigned int flags, ipmi_rsp_handler handler, void *arg);
+
 int sel_init(unsigned char *hostname, unsigned char *username, unsigned char *password);
 int get_event(unsigned char *buf, unsigned char maxlen, unsigned short *entry_nb);
 
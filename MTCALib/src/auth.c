@@ -35,12 +35,14 @@
 #include <inttypes.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 //#include <ipmitool/helper.h>
 //#include <ipmitool/bswap.h>
 #include <ipmi.h>
 #include <ipmi_intf.h>
+#include "auth.h"
 
 #if HAVE_CONFIG_H
 # include <config.h>
@@ -60,63 +62,68 @@
  * multi-session authcode generation for MD5
  * H(password + session_id + msg + session_seq + password)
  *
+ * The 16 byte digest is written to md, which is also returned.
  * Use OpenSSL implementation of MD5 algorithm if found
  */
-uint8_t * ipmi_auth_md5(struct ipmi_session * s, uint8_t * data, int data_len)
+uint8_t * ipmi_auth_md5(struct ipmi_session * s, uint8_t * data, int data_len, uint8_t * md)
 {
-#ifdef HAVE_CRYPTO_MD5
-	MD5_CTX ctx;
-	static uint8_t md[16];
+	struct iovec iov = { data, data_len };
+
+	return ipmi_auth_md5_iov(s, &iov, 1, md);
+}
+
+/*
+ * Same, with the message given in pieces: a payload is hashed where
+ * it lies instead of being copied after the message header.
+ */
+uint8_t * ipmi_auth_md5_iov(struct ipmi_session * s, const struct iovec * iov, int iovcnt, uint8_t * md)
+{
+	ipmi_md5_ctx ctx;
 	uint32_t temp;
+	int i;
 
 #if WORDS_BIGENDIAN
 	temp = BSWAP_32(s->in_seq);
 #else
 	temp = s->in_seq;
 #endif
-	memset(md, 0, 16);
-	memset(&ctx, 0, sizeof(MD5_CTX));
 
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, (const uint8_t *)s->authcode, 16);
-	MD5_Update(&ctx, (const uint8_t *)&s->session_id, 4);
-	MD5_Update(&ctx, (const uint8_t *)data, data_len);
+	/*
+	 * password + session_id is the same for every packet of the session:
+	 * hash it once and start each authcode from a copy of that state.
+	 */
+	if (!s->md5_prefix_valid || s->md5_prefix_id != s->session_id) {
+#ifdef HAVE_CRYPTO_MD5
+		MD5_Init(&s->md5_prefix);
+		MD5_Update(&s->md5_prefix, (const uint8_t *)s->authcode, 16);
+		MD5_Update(&s->md5_prefix, (const uint8_t *)&s->session_id, 4);
+#else
+		md5_init(&s->md5_prefix);
+		md5_append(&s->md5_prefix, (const md5_byte_t *)s->authcode, 16);
+		md5_append(&s->md5_prefix, (const md5_byte_t *)&s->session_id, 4);
+#endif
+		s->md5_prefix_id = s->session_id;
+		s->md5_prefix_valid = 1;
+	}
+	memcpy(&ctx, &s->md5_prefix, sizeof(ctx));
+
+#ifdef HAVE_CRYPTO_MD5
+	for (i = 0; i < iovcnt; i++)
+		MD5_Update(&ctx, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
 	MD5_Update(&ctx, (const uint8_t *)&temp, sizeof(uint32_t));
 	MD5_Update(&ctx, (const uint8_t *)s->authcode, 16);
 	MD5_Final(md, &ctx);
+#else /*HAVE_CRYPTO_MD5*/
+	for (i = 0; i < iovcnt; i++)
+		md5_append(&ctx, (const md5_byte_t *)iov[i].iov_base, iov[i].iov_len);
+	md5_append(&ctx, (const md5_byte_t *)&temp, 4);
+	md5_append(&ctx, (const md5_byte_t *)s->authcode, 16);
+	md5_finish(&ctx, (md5_byte_t *)md);
+#endif /*HAVE_CRYPTO_MD5*/
 
 	//if (verbose > 3)
 	//	printf("  MD5 AuthCode    : %s\n", buf2str(md, 16));
-
 	return md;
-#else /*HAVE_CRYPTO_MD5*/
-	md5_state_t state;
-	static md5_byte_t digest[16];
-	uint32_t temp;
-
-	memset(digest, 0, 16);
-	memset(&state, 0, sizeof(md5_state_t));
-
-	md5_init(&state);
-
-	md5_append(&state, (const md5_byte_t *)s->authcode, 16);
-	md5_append(&state, (const md5_byte_t *)&s->session_id, 4);
-	md5_append(&state, (const md5_byte_t *)data, data_len);
-
-#if WORDS_BIGENDIAN
-	temp = BSWAP_32(s->in_seq);
-#else
-	temp = s->in_seq;
-#endif
-	md5_append(&state, (const md5_byte_t *)&temp, 4);
-	md5_append(&state, (const md5_byte_t *)s->authcode, 16);
-
-	md5_finish(&state, digest);
-
-	//if (verbose > 3)
-	//	printf("  MD5 AuthCode    : %s\n", buf2str(digest, 16));
-	return digest;
-#endif /*HAVE_CRYPTO_MD5*/
 }
 
 /* 
@@ -126,12 +133,19 @@ uint8_t * ipmi_auth_md5(struct ipmi_session * s, uint8_t * data, int data_len)
  * Use OpenSSL implementation of MD2 algorithm if found.
  * This function is analogous to ipmi_auth_md5
  */
-uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len)
+uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len, uint8_t * md)
+{
+	struct iovec iov = { data, data_len };
+
+	return ipmi_auth_md2_iov(s, &iov, 1, md);
+}
+
+uint8_t * ipmi_auth_md2_iov(struct ipmi_session * s, const struct iovec * iov, int iovcnt, uint8_t * md)
 {
 #ifdef HAVE_CRYPTO_MD2
 	MD2_CTX ctx;
-	static uint8_t md[16];
 	uint32_t temp;
+	int i;
 
 #if WORDS_BIGENDIAN
 	temp = BSWAP_32(s->in_seq);
@@ -144,7 +158,8 @@ uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len)
 	MD2_Init(&ctx);
 	MD2_Update(&ctx, (const uint8_t *)s->authcode, 16);
 	MD2_Update(&ctx, (const uint8_t *)&s->session_id, 4);
-	MD2_Update(&ctx, (const uint8_t *)data, data_len);
+	for (i = 0; i < iovcnt; i++)
+		MD2_Update(&ctx, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
 	MD2_Update(&ctx, (const uint8_t *)&temp, sizeof(uint32_t));
 	MD2_Update(&ctx, (const uint8_t *)s->authcode, 16);
 	MD2_Final(md, &ctx);
@@ -154,7 +169,9 @@ uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len)
 
 	return md;
 #else /*HAVE_CRYPTO_MD2*/
-	static uint8_t md[16];
+	(void)s;
+	(void)iov;
+	(void)iovcnt;
 	memset(md, 0, 16);
 	printf("WARNING: No internal support for MD2!  "
 	       "Please re-compile with OpenSSL.\n");
@@ -163,11 +180,10 @@ uint8_t * ipmi_auth_md2(struct ipmi_session * s, uint8_t * data, int data_len)
 }
 
 /* special authentication method */
-uint8_t * ipmi_auth_special(struct ipmi_session * s)
+uint8_t * ipmi_auth_special(struct ipmi_session * s, uint8_t * md)
 {
 #ifdef HAVE_CRYPTO_MD5
 	MD5_CTX ctx;
-	static uint8_t md[16];
 	uint8_t challenge[16];
 	int i;
 
@@ -193,7 +209,7 @@ uint8_t * ipmi_auth_special(struct ipmi_session * s)
 #else  /*HAVE_CRYPTO_MD5*/
 	int i;
 	md5_state_t state;
-	static md5_byte_t digest[16];
+	md5_byte_t * digest = (md5_byte_t *)md;
 	uint8_t challenge[16];
 
 	memset(challenge, 0, 16);
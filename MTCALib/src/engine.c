@@ -0,0 +1,735 @@
+#include <ipmi.h>
+#include <ipmi_intf.h>
+#include <ipmi_engine.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define IPMI_ENGINE_SEQ		64
+#define IPMI_ENGINE_MAX_WAIT	3600000000UL	/* us, longest sleep in ipmi_engine_run() */
+
+struct ipmi_engine_rq {
+	struct ipmi_rq req;
+	uint8_t data[IPMI_ENGINE_MAX_DATA];
+	ipmi_rsp_handler handler;
+	void * arg;
+	struct ipmi_engine_session * es;
+	struct ipmi_timer timer;		/* retransmission */
+	uint64_t rto;				/* us, current retransmission timeout */
+	uint64_t reuse;				/* us, the seq may still get a late answer until then */
+	int tries;
+	int active;
+	struct ipmi_engine_rq * next;		/* backlog */
+};
+
+/* Per-session state: outstanding requests by rq_seq, and those waiting for a free seq */
+struct ipmi_engine_session {
+	struct ipmi_engine * engine;
+	struct ipmi_intf * intf;
+	struct ipmi_engine_rq rq[IPMI_ENGINE_SEQ];
+	int outstanding;
+	int next_seq;
+	struct ipmi_engine_rq * backlog;
+	struct ipmi_engine_rq * backlog_tail;
+	struct ipmi_timer keepalive;
+	uint64_t last_sent;			/* us, last request or retry sent */
+
+	/* ipmi_engine_attach_async(): requests are held in the backlog until the session is active */
+	int opening;
+	int failed;				/* the handshake failed, requests are refused */
+	ipmi_open_handler open_handler;
+	void * open_arg;
+	struct ipmi_engine_rq handshake;	/* handshake request to send again, on its timer */
+
+	/* ipmi_engine_close(): detached by ipmi_engine_run() once closed */
+	int closing;
+	int closed;
+	ipmi_close_handler close_handler;
+	void * close_arg;
+	struct ipmi_engine_session * next;
+};
+
+struct ipmi_engine {
+	int epfd;
+	int pending;				/* requests (sent or queued) and timers */
+	struct ipmi_engine_session * sessions;
+	struct ipmi_timer_wheel wheel;		/* retransmissions and timers, 1 ms ticks */
+};
+
+static uint64_t ipmi_engine_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wheel tick of a time: rounded up, so that a timer never fires early */
+static uint64_t ipmi_engine_tick(uint64_t us)
+{
+	return (us + 999) / 1000;
+}
+
+static uint64_t ipmi_engine_max_rto(struct ipmi_intf * intf)
+{
+	return (uint64_t)intf->session->timeout * 1000000;
+}
+
+/* Longest idle time of a session: half its inactivity timeout leaves room to retry a keepalive */
+static uint64_t ipmi_engine_idle_max(struct ipmi_intf * intf)
+{
+	return (uint64_t)intf->session->inactivity * 1000000 / 2;
+}
+
+static void ipmi_engine_retransmit(void * arg);
+static void ipmi_engine_keepalive(void * arg);
+static void ipmi_engine_flush_backlog(struct ipmi_engine * e, struct ipmi_engine_session * es);
+static int ipmi_engine_issue(struct ipmi_engine * e, struct ipmi_engine_session * es,
+			     struct ipmi_rq * req, ipmi_rsp_handler handler, void * arg);
+
+struct ipmi_engine * ipmi_engine_create(void)
+{
+	struct ipmi_engine * e;
+
+	e = malloc(sizeof(struct ipmi_engine));
+	if (e == NULL)
+		return NULL;
+	memset(e, 0, sizeof(struct ipmi_engine));
+
+	e->epfd = epoll_create1(0);
+	if (e->epfd < 0) {
+		free(e);
+		return NULL;
+	}
+	ipmi_timer_init(&e->wheel, ipmi_engine_time_us() / 1000);
+
+	return e;
+}
+
+static int ipmi_engine_reap(struct ipmi_engine * e, int all);
+
+void ipmi_engine_free(struct ipmi_engine * e)
+{
+	if (e == NULL)
+		return;
+
+	ipmi_engine_reap(e, 1);
+	while (e->sessions != NULL)
+		ipmi_engine_detach(e, e->sessions->intf);
+
+	close(e->epfd);
+	free(e);
+}
+
+/* Start watching an opened session */
+static struct ipmi_engine_session * ipmi_engine_watch(struct ipmi_engine * e, struct ipmi_intf * intf)
+{
+	struct ipmi_engine_session * es;
+	struct epoll_event ev;
+
+	es = malloc(sizeof(struct ipmi_engine_session));
+	if (es == NULL)
+		return NULL;
+	memset(es, 0, sizeof(struct ipmi_engine_session));
+	es->engine = e;
+	es->intf = intf;
+	es->last_sent = ipmi_engine_time_us();
+
+	/* a shared socket is watched once, for all its sessions */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = es;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, intf->fd, &ev) < 0 &&
+	    (errno != EEXIST || intf->sock == NULL)) {
+		free(es);
+		return NULL;
+	}
+
+	intf->engine = es;
+	intf->tx_batch = 1;
+	es->next = e->sessions;
+	e->sessions = es;
+
+	es->keepalive.handler = ipmi_engine_keepalive;
+	es->keepalive.arg = es;
+	return es;
+}
+
+static void ipmi_engine_arm_keepalive(struct ipmi_engine * e, struct ipmi_engine_session * es)
+{
+	ipmi_timer_arm(&e->wheel, &es->keepalive, ipmi_engine_tick(es->last_sent + ipmi_engine_idle_max(es->intf)));
+}
+
+int ipmi_engine_attach(struct ipmi_engine * e, struct ipmi_intf * intf)
+{
+	struct ipmi_engine_session * es;
+
+	if (e == NULL || intf == NULL || intf->engine != NULL)
+		return -1;
+
+	if (intf->opened == 0 && intf->open != NULL) {
+		if (intf->open(intf) < 0)
+			return -1;
+	}
+
+	es = ipmi_engine_watch(e, intf);
+	if (es == NULL)
+		return -1;
+
+	ipmi_engine_arm_keepalive(e, es);
+	return 0;
+}
+
+static void ipmi_engine_handshake(struct ipmi_intf * intf, struct ipmi_rs * rsp, void * arg);
+
+/* Handshake request again, one RTO after the last one failed */
+static void ipmi_engine_handshake_retry(void * arg)
+{
+	struct ipmi_engine_session * es = arg;
+	struct ipmi_engine * e = es->engine;
+
+	if (ipmi_engine_issue(e, es, &es->handshake.req, ipmi_engine_handshake, es) < 0) {
+		ipmi_engine_handshake(es->intf, NULL, es);
+		return;
+	}
+	e->pending++;
+}
+
+/* Go on with the handshake as the LAN interface asks, or end it */
+static void ipmi_engine_handshake_step(struct ipmi_engine_session * es, int rc, struct ipmi_rq * req)
+{
+	struct ipmi_engine * e = es->engine;
+	struct ipmi_intf * intf = es->intf;
+	struct ipmi_engine_rq * rq;
+
+	if (rc == IPMI_HANDSHAKE_SEND) {
+		if (ipmi_engine_issue(e, es, req, ipmi_engine_handshake, es) == 0) {
+			e->pending++;
+			return;
+		}
+		rc = -1;
+	} else if (rc == IPMI_HANDSHAKE_RETRY) {
+		memcpy(&es->handshake.req, req, sizeof(struct ipmi_rq));
+		memcpy(es->handshake.data, req->msg.data, req->msg.data_len);
+		es->handshake.req.msg.data = es->handshake.data;
+		ipmi_engine_timer(e, &es->handshake.timer, intf->session->rto, ipmi_engine_handshake_retry, es);
+		return;
+	}
+
+	es->opening = 0;
+	if (rc == 0) {
+		ipmi_engine_arm_keepalive(e, es);
+		es->open_handler(intf, 0, es->open_arg);
+		ipmi_engine_flush_backlog(e, es);
+		return;
+	}
+
+	es->failed = 1;
+	es->open_handler(intf, -1, es->open_arg);
+	while ((rq = es->backlog) != NULL) {
+		es->backlog = rq->next;
+		e->pending--;
+		rq->handler(intf, NULL, rq->arg);
+		free(rq);
+	}
+}
+
+static void ipmi_engine_handshake(struct ipmi_intf * intf, struct ipmi_rs * rsp, void * arg)
+{
+	struct ipmi_rq req;
+
+	ipmi_engine_handshake_step(arg, intf->handshake(intf, rsp, &req), &req);
+}
+
+int ipmi_engine_attach_async(struct ipmi_engine * e, struct ipmi_intf * intf,
+			     ipmi_open_handler handler, void * arg)
+{
+	struct ipmi_engine_session * es;
+	struct ipmi_rq req;
+
+	if (e == NULL || intf == NULL || intf->engine != NULL || handler == NULL ||
+	    intf->opened || intf->connect == NULL || intf->handshake == NULL)
+		return -1;
+
+	if (intf->connect(intf) < 0)
+		return -1;
+
+	es = ipmi_engine_watch(e, intf);
+	if (es == NULL)
+		return -1;
+
+	es->opening = 1;
+	es->open_handler = handler;
+	es->open_arg = arg;
+	ipmi_engine_handshake_step(es, intf->handshake(intf, NULL, &req), &req);
+
+	return 0;
+}
+
+void ipmi_engine_detach(struct ipmi_engine * e, struct ipmi_intf * intf)
+{
+	struct ipmi_engine_session * es, * other, ** p;
+	struct ipmi_engine_rq * rq;
+	int i;
+
+	if (e == NULL || intf == NULL || intf->engine == NULL)
+		return;
+
+	es = intf->engine;
+	for (p = &e->sessions; *p != NULL && *p != es; p = &(*p)->next);
+	if (*p == NULL)
+		return;
+	*p = es->next;
+
+	ipmi_timer_cancel(&e->wheel, &es->keepalive);
+	ipmi_engine_timer_cancel(e, &es->handshake.timer);
+	for (i = 0; i < IPMI_ENGINE_SEQ; i++) {
+		if (es->rq[i].active) {
+			ipmi_timer_cancel(&e->wheel, &es->rq[i].timer);
+			intf->cancel(intf, i);
+			e->pending--;
+		}
+	}
+	while ((rq = es->backlog) != NULL) {
+		es->backlog = rq->next;
+		free(rq);
+		e->pending--;
+	}
+
+	intf->flush(intf);
+	intf->tx_batch = 0;
+
+	/* a shared socket stays watched for the other sessions using it */
+	for (other = e->sessions; other != NULL && other->intf->sock != intf->sock; other = other->next);
+	if (intf->sock != NULL && other != NULL) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = other;
+		epoll_ctl(e->epfd, EPOLL_CTL_MOD, intf->fd, &ev);
+	} else if (intf->fd >= 0) {
+		epoll_ctl(e->epfd, EPOLL_CTL_DEL, intf->fd, NULL);
+	}
+	intf->engine = NULL;
+	free(es);
+}
+
+static void ipmi_engine_closed(struct ipmi_intf * intf, struct ipmi_rs * rsp, void * arg)
+{
+	struct ipmi_engine_session * es = arg;
+
+	(void)intf;
+	(void)rsp;
+	es->closed = 1;
+}
+
+int ipmi_engine_close(struct ipmi_engine * e, struct ipmi_intf * intf,
+		      ipmi_close_handler handler, void * arg)
+{
+	struct ipmi_engine_session * es;
+	struct ipmi_rq req;
+
+	if (e == NULL || intf == NULL || intf->engine == NULL || handler == NULL)
+		return -1;
+	es = intf->engine;
+	if (es->closing)
+		return -1;
+
+	es->closing = 1;
+	ipmi_timer_cancel(&e->wheel, &es->keepalive);
+	es->close_handler = handler;
+	es->close_arg = arg;
+	e->pending++;				/* until it is detached */
+
+	/* a session never activated has nothing to close */
+	if (intf->close_req == NULL || intf->close_req(intf, &req) < 0 ||
+	    ipmi_engine_send(e, intf, &req, ipmi_engine_closed, es) < 0)
+		es->closed = 1;
+
+	return 0;
+}
+
+/*
+ * Detach the closed sessions, or all those being closed, and hand them
+ * back. Done outside any handler, since detaching frees the session state.
+ */
+static int ipmi_engine_reap(struct ipmi_engine * e, int all)
+{
+	struct ipmi_engine_session * es, * next;
+	struct ipmi_intf * intf;
+	ipmi_close_handler handler;
+	void * arg;
+	int n = 0;
+
+	for (es = e->sessions; es != NULL; es = next) {
+		next = es->next;
+		if (!es->closing || (!es->closed && !all))
+			continue;
+
+		intf = es->intf;
+		handler = es->close_handler;
+		arg = es->close_arg;
+		ipmi_engine_detach(e, intf);
+		e->pending--;
+		if (intf->session != NULL)
+			intf->session->active = 0;	/* Close Session already sent */
+		handler(intf, arg);
+		n++;
+	}
+
+	return n;
+}
+
+/* Complete a request: the handler may queue new ones, which may take its seq */
+static void ipmi_engine_complete(struct ipmi_engine * e, struct ipmi_engine_session * es,
+				 struct ipmi_engine_rq * rq, struct ipmi_rs * rsp)
+{
+	ipmi_rsp_handler handler = rq->handler;
+	void * arg = rq->arg;
+
+	/* another copy of a retried request, or a request given up, may still be answered */
+	rq->reuse = (rq->tries > 1 || rsp == NULL) ? ipmi_engine_time_us() + rq->rto : 0;
+	ipmi_timer_cancel(&e->wheel, &rq->timer);
+	rq->active = 0;
+	es->outstanding--;
+	e->pending--;
+
+	handler(es->intf, rsp, arg);
+}
+
+static int ipmi_engine_seq_taken(struct ipmi_intf * intf, int seq)
+{
+	return intf->seq_taken != NULL && intf->seq_taken(intf, seq);
+}
+
+/* Send a request with a free rq_seq of its session, copying it into that seq's entry */
+static int ipmi_engine_issue(struct ipmi_engine * e, struct ipmi_engine_session * es,
+			     struct ipmi_rq * req, ipmi_rsp_handler handler, void * arg)
+{
+	struct ipmi_intf * intf = es->intf;
+	struct ipmi_engine_rq * rq;
+	uint64_t now = ipmi_engine_time_us();
+	int seq, i;
+
+	/* round robin, skipping the seqs that may still be answered and those another session waits on */
+	for (i = 0, seq = es->next_seq; i < IPMI_ENGINE_SEQ; i++, seq = (seq + 1) % IPMI_ENGINE_SEQ) {
+		if (!es->rq[seq].active && es->rq[seq].reuse <= now && !ipmi_engine_seq_taken(intf, seq))
+			break;
+	}
+	for (i = 0; i < IPMI_ENGINE_SEQ && (es->rq[seq].active || ipmi_engine_seq_taken(intf, seq)); i++, seq = (seq + 1) % IPMI_ENGINE_SEQ);
+	for (; es->rq[seq].active; seq = (seq + 1) % IPMI_ENGINE_SEQ);
+	es->next_seq = (seq + 1) % IPMI_ENGINE_SEQ;
+
+	rq = &es->rq[seq];
+	memcpy(&rq->req, req, sizeof(struct ipmi_rq));
+	if (req->msg.data_len)
+		memcpy(rq->data, req->msg.data, req->msg.data_len);
+	rq->req.msg.data = rq->data;
+	rq->handler = handler;
+	rq->arg = arg;
+	rq->es = es;
+	rq->next = NULL;
+	rq->tries = 1;
+	rq->rto = ((intf->session->retry == -1 || req->no_retry) && !req->once) ? ipmi_engine_max_rto(intf) : intf->session->rto;
+
+	if (intf->send_seq(intf, &rq->req, seq, 0) < 0)
+		return -1;
+
+	rq->timer.handler = ipmi_engine_retransmit;
+	rq->timer.arg = rq;
+	ipmi_timer_arm(&e->wheel, &rq->timer, ipmi_engine_tick(now + rq->rto));
+	es->last_sent = now;
+	rq->active = 1;
+	es->outstanding++;
+	return 0;
+}
+
+int ipmi_engine_send(struct ipmi_engine * e, struct ipmi_intf * intf, struct ipmi_rq * req,
+		     ipmi_rsp_handler handler, void * arg)
+{
+	struct ipmi_engine_session * es;
+	struct ipmi_engine_rq * rq;
+
+	if (e == NULL || intf == NULL || intf->engine == NULL || req->msg.data_len > IPMI_ENGINE_MAX_DATA)
+		return -1;
+	es = intf->engine;
+	if (es->failed)
+		return -1;
+
+	if (!es->opening && es->outstanding < IPMI_ENGINE_MAX_OUTSTANDING) {
+		if (ipmi_engine_issue(e, es, req, handler, arg) < 0)
+			return -1;
+	} else {
+		/* every seq is in flight, or the session is not active yet: keep a copy and send it later */
+		rq = malloc(sizeof(struct ipmi_engine_rq));
+		if (rq == NULL)
+			return -1;
+		memset(rq, 0, sizeof(struct ipmi_engine_rq));
+		memcpy(&rq->req, req, sizeof(struct ipmi_rq));
+		if (req->msg.data_len)
+			memcpy(rq->data, req->msg.data, req->msg.data_len);
+		rq->req.msg.data = rq->data;
+		rq->handler = handler;
+		rq->arg = arg;
+
+		if (es->backlog == NULL)
+			es->backlog = rq;
+		else
+			es->backlog_tail->next = rq;
+		es->backlog_tail = rq;
+	}
+
+	e->pending++;
+	return 0;
+}
+
+int ipmi_engine_timer(struct ipmi_engine * e, struct ipmi_timer * t, unsigned long delay_us,
+		      ipmi_timer_handler handler, void * arg)
+{
+	if (e == NULL || t == NULL)
+		return -1;
+
+	if (!ipmi_timer_armed(t))
+		e->pending++;
+	t->handler = handler;
+	t->arg = arg;
+	ipmi_timer_arm(&e->wheel, t, ipmi_engine_tick(ipmi_engine_time_us() + delay_us));
+
+	return 0;
+}
+
+void ipmi_engine_timer_cancel(struct ipmi_engine * e, struct ipmi_timer * t)
+{
+	if (e == NULL || t == NULL || !ipmi_timer_armed(t))
+		return;
+
+	ipmi_timer_cancel(&e->wheel, t);
+	e->pending--;
+}
+
+/* Move queued requests into the seqs freed by completed ones */
+static void ipmi_engine_flush_backlog(struct ipmi_engine * e, struct ipmi_engine_session * es)
+{
+	struct ipmi_engine_rq * rq;
+
+	if (es->opening)
+		return;
+
+	while (es->backlog != NULL && es->outstanding < IPMI_ENGINE_MAX_OUTSTANDING) {
+		rq = es->backlog;
+		es->backlog = rq->next;
+
+		if (ipmi_engine_issue(e, es, &rq->req, rq->handler, rq->arg) < 0) {
+			e->pending--;
+			rq->handler(es->intf, NULL, rq->arg);
+		}
+		free(rq);
+	}
+}
+
+/* Read every datagram queued on a session and hand the responses out */
+static void ipmi_engine_read(struct ipmi_engine * e, struct ipmi_engine_session * es)
+{
+	struct ipmi_intf * intf = es->intf;
+	struct ipmi_engine_rq * rq;
+	struct ipmi_rs * rsp;
+
+	for (;;) {
+		/* NULL for a pong: the responses batched with it are still buffered */
+		rsp = intf->recv(intf, 0);
+		if (rsp == NULL) {
+			if (intf->opened && intf->rx_next < intf->rx_count)
+				continue;
+			break;
+		}
+
+		if (rsp->session.payloadtype != IPMI_PAYLOAD_TYPE_IPMI)
+			continue;
+
+		rq = &es->rq[rsp->payload.ipmi_response.rq_seq % IPMI_ENGINE_SEQ];
+		if (!rq->active)
+			continue;
+
+		/* An answer to an earlier copy is on its way, the LAN interface still accepts it: wait for it or for the timer */
+		if (rsp->ccode == IPMI_CC_CANT_RESP_DUPLI_REQ)
+			continue;
+
+		ipmi_engine_complete(e, es, rq, rsp);
+	}
+
+	ipmi_engine_flush_backlog(e, es);
+}
+
+/*
+ * Read a shared socket: reading through one session routes the datagrams
+ * of the others to their rings, so go over them until every ring is empty.
+ */
+static void ipmi_engine_read_shared(struct ipmi_engine * e, struct ipmi_lan_socket * sock)
+{
+	struct ipmi_engine_session * es, * next;
+	int again;
+
+	do {
+		for (es = e->sessions; es != NULL; es = next) {
+			next = es->next;
+			if (es->intf->sock == sock)
+				ipmi_engine_read(e, es);
+		}
+
+		again = 0;
+		for (es = e->sessions; es != NULL; es = es->next) {
+			if (es->intf->sock == sock && es->intf->rx_next < es->intf->rx_count)
+				again = 1;
+		}
+	} while (again);
+}
+
+/* Retransmission timer of a request: send it again, or fail it once out of tries */
+static void ipmi_engine_retransmit(void * arg)
+{
+	struct ipmi_engine_rq * rq = arg;
+	struct ipmi_engine_session * es = rq->es;
+	struct ipmi_engine * e = es->engine;
+	struct ipmi_intf * intf = es->intf;
+	int seq = rq - es->rq;
+	int max_tries;
+
+	max_tries = (intf->session->retry > 0 && !rq->req.once && !rq->req.no_retry) ? intf->session->retry : 1;
+
+	if (rq->tries < max_tries) {
+		rq->tries++;
+		rq->rto *= 2;
+		if (rq->rto > ipmi_engine_max_rto(intf))
+			rq->rto = ipmi_engine_max_rto(intf);
+
+		if (intf->send_seq(intf, &rq->req, seq, 1) >= 0) {
+			es->last_sent = ipmi_engine_time_us();
+			ipmi_timer_arm(&e->wheel, &rq->timer, ipmi_engine_tick(es->last_sent + rq->rto));
+			return;
+		}
+	}
+
+	intf->cancel(intf, seq);
+	ipmi_engine_complete(e, es, rq, NULL);
+	ipmi_engine_flush_backlog(e, es);
+}
+
+/* The answer does not matter: sending the request reset the BMC's timer */
+static void ipmi_engine_keepalive_done(struct ipmi_intf * intf, struct ipmi_rs * rsp, void * arg)
+{
+	(void)intf;
+	(void)rsp;
+	(void)arg;
+}
+
+/*
+ * Keepalive timer of a session, due once it was idle for half its
+ * inactivity timeout: any request resets the BMC's timer, so send it a
+ * Get Device ID. A session kept busy never sends one, its timer only
+ * moves after the last request. It stops with the session: once it
+ * failed, is being closed or is no longer active.
+ */
+static void ipmi_engine_keepalive(void * arg)
+{
+	struct ipmi_engine_session * es = arg;
+	struct ipmi_engine * e = es->engine;
+	uint64_t now = ipmi_engine_time_us();
+	uint64_t next;
+	struct ipmi_rq req;
+
+	if (es->failed || es->closing || es->intf->session == NULL || !es->intf->session->active)
+		return;
+
+	if (now - es->last_sent >= ipmi_engine_idle_max(es->intf)) {
+		memset(&req, 0, sizeof(req));
+		req.msg.netfn = IPMI_NETFN_APP;
+		req.msg.cmd = 0x01;
+		ipmi_engine_send(e, es->intf, &req, ipmi_engine_keepalive_done, NULL);
+	}
+
+	next = es->last_sent + ipmi_engine_idle_max(es->intf);
+	if (next <= now)
+		next = now + ipmi_engine_idle_max(es->intf);	/* could not send: try again later */
+	ipmi_timer_arm(&e->wheel, &es->keepalive, ipmi_engine_tick(next));
+}
+
+/*
+ * Attached sessions only queue the frames of new requests and retries:
+ * send what accumulated, in one sendmmsg() per session.
+ */
+static void ipmi_engine_flush(struct ipmi_engine * e)
+{
+	struct ipmi_engine_session * es;
+
+	for (es = e->sessions; es != NULL; es = es->next)
+		es->intf->flush(es->intf);
+}
+
+/* Run the handler of every timer due, retransmissions and ipmi_engine_timer() alike */
+static void ipmi_engine_expire_timers(struct ipmi_engine * e, uint64_t now)
+{
+	struct ipmi_timer * t;
+
+	while ((t = ipmi_timer_pop(&e->wheel, now / 1000)) != NULL) {
+		/* the engine's own timers are not counted as pending */
+		if (t->handler != ipmi_engine_retransmit && t->handler != ipmi_engine_keepalive)
+			e->pending--;
+		t->handler(t->arg);
+	}
+}
+
+int ipmi_engine_run(struct ipmi_engine * e, unsigned long timeout_us)
+{
+	struct epoll_event events[IPMI_ENGINE_MAX_EVENTS];
+	struct ipmi_engine_session * es;
+	uint64_t now, next;
+	int i, n, timeout_ms;
+
+	if (e == NULL)
+		return -1;
+
+	/* the last sessions closed: nothing left to wait for */
+	if (ipmi_engine_reap(e, 0) > 0 && e->pending == 0)
+		return 0;
+
+	/* datagrams routed to a session of a shared socket since the last run */
+	for (es = e->sessions; es != NULL; es = es->next) {
+		if (es->intf->sock != NULL && es->intf->rx_next < es->intf->rx_count)
+			ipmi_engine_read_shared(e, es->intf->sock);
+	}
+
+	/* requests queued since the last run */
+	ipmi_engine_flush(e);
+
+	/* sleep until the first timer or retransmission is due */
+	if (timeout_us > IPMI_ENGINE_MAX_WAIT)
+		timeout_us = IPMI_ENGINE_MAX_WAIT;
+
+	now = ipmi_engine_time_us();
+	next = ipmi_timer_next(&e->wheel);
+	if (next != UINT64_MAX && next * 1000 < now + timeout_us)
+		timeout_us = (next * 1000 > now) ? next * 1000 - now : 0;
+	timeout_ms = (timeout_us + 999) / 1000;
+
+	n = epoll_wait(e->epfd, events, IPMI_ENGINE_MAX_EVENTS, timeout_ms);
+	if (n < 0 && errno != EINTR)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		es = events[i].data.ptr;
+		if (es->intf->sock != NULL)
+			ipmi_engine_read_shared(e, es->intf->sock);
+		else
+			ipmi_engine_read(e, es);
+	}
+
+	ipmi_engine_expire_timers(e, ipmi_engine_time_us());
+	ipmi_engine_flush(e);
+	ipmi_engine_reap(e, 0);
+
+	return e->pending;
+}
@@ -30,6 +30,7 @@
  * EVEN IF SUN HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
  */
 
+#define _GNU_SOURCE		/* sendmmsg(), recvmmsg() */
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -42,6 +43,7 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <ipmi.h>
 #include <ipmi_intf.h>
@@ -57,20 +59,39 @@
 
 #define IPMI_LAN_TIMEOUT	200
 #define IPMI_LAN_RETRY		4
+#define IPMI_LAN_RTO_INIT	1000000	/* us, until the first RTT sample */
+#define IPMI_LAN_INACTIVITY	60	/* s, session inactivity timeout of IPMI v1.5 */
+#define IPMI_LAN_RTO_MIN	20000	/* us */
 #define IPMI_LAN_PORT		0x26f
 #define IPMI_LAN_CHANNEL_E	0x0e
 
-struct ipmi_rq_entry * ipmi_req_entries;
-static struct ipmi_rq_entry * ipmi_req_entries_tail;
-static uint8_t bridge_possible = 0;
+/* Handshake steps, by request in flight */
+enum {
+	IPMI_LAN_HS_START = 0,
+	IPMI_LAN_HS_CAPS,
+	IPMI_LAN_HS_CHALLENGE,
+	IPMI_LAN_HS_ACTIVATE,
+	IPMI_LAN_HS_PRIVLVL,
+	IPMI_LAN_HS_DONE,
+	IPMI_LAN_HS_FAILED,
+};
 
 static int ipmi_lan_send_packet(struct ipmi_intf * intf, uint8_t * data, int data_len);
-static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf);
-static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf);
+static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf, struct timeval * tmout);
+static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf, struct timeval * tmout);
 static int ipmi_lan_setup(struct ipmi_intf * intf);
 static int ipmi_lan_keepalive(struct ipmi_intf * intf);
 static struct ipmi_rs * ipmi_lan_send_cmd(struct ipmi_intf * intf, struct ipmi_rq * req);
+static int ipmi_lan_send_async(struct ipmi_intf * intf, struct ipmi_rq * req);
+static struct ipmi_rs * ipmi_lan_recv_async(struct ipmi_intf * intf, unsigned long timeout_us);
+static void ipmi_lan_cancel(struct ipmi_intf * intf, uint8_t seq);
+static int ipmi_lan_send_seq(struct ipmi_intf * intf, struct ipmi_rq * req, uint8_t seq, int retry);
+static int ipmi_lan_seq_taken(struct ipmi_intf * intf, uint8_t seq);
+static int ipmi_lan_flush(struct ipmi_intf * intf);
 static int ipmi_lan_open(struct ipmi_intf * intf);
+static int ipmi_lan_connect(struct ipmi_intf * intf);
+static int ipmi_lan_handshake(struct ipmi_intf * intf, struct ipmi_rs * rsp, struct ipmi_rq * req);
+static int ipmi_close_session_req(struct ipmi_intf * intf, struct ipmi_rq * req);
 static void ipmi_lan_close(struct ipmi_intf * intf);
 static int ipmi_lan_ping(struct ipmi_intf * intf);
 
@@ -79,8 +100,17 @@ struct ipmi_intf ipmi_lan_intf = {
 	desc:		"IPMI v1.5 LAN Interface",
 	setup:		ipmi_lan_setup,
 	open:		ipmi_lan_open,
+	connect:	ipmi_lan_connect,
+	handshake:	ipmi_lan_handshake,
+	close_req:	ipmi_close_session_req,
 	close:		ipmi_lan_close,
 	sendrecv:	ipmi_lan_send_cmd,
+	send:		ipmi_lan_send_async,
+	recv:		ipmi_lan_recv_async,
+	cancel:		ipmi_lan_cancel,
+	send_seq:	ipmi_lan_send_seq,
+	seq_taken:	ipmi_lan_seq_taken,
+	flush:		ipmi_lan_flush,
 	keepalive:	ipmi_lan_keepalive,
 	target_addr:	IPMI_BMC_SLAVE_ADDR,
 };
@@ -97,88 +127,52 @@ uint8_t ipmi_csum(uint8_t * d, int s){
 	return -c;
 }
 
+/*
+ * Outstanding requests live in a table indexed by their rq_seq, so a
+ * response finds its request directly and requests can be retired one at
+ * a time while others are still in flight. Each entry also holds the
+ * buffer its frame is built in: sending a request allocates nothing.
+ */
 static struct ipmi_rq_entry * ipmi_req_add_entry(struct ipmi_intf * intf, struct ipmi_rq * req, uint8_t req_seq)
 {
-	struct ipmi_rq_entry * e;
-
-	e = malloc(sizeof(struct ipmi_rq_entry));
-	if (e == NULL) {
-		return NULL;
-	}
+	struct ipmi_rq_entry * e = &intf->req_entries[req_seq % IPMI_RQ_SEQ_MAX];
 
-	memset(e, 0, sizeof(struct ipmi_rq_entry));
 	memcpy(&e->req, req, sizeof(struct ipmi_rq));
 
 	e->intf = intf;
 	e->rq_seq = req_seq;
+	e->msg_len = 0;
+	e->bridging_level = 0;
+	e->retried = 0;
+	e->queued = 0;
+	e->sent = 0;
+	e->active = 1;
 
-	if (ipmi_req_entries == NULL)
-		ipmi_req_entries = e;
-	else
-		ipmi_req_entries_tail->next = e;
-
-	ipmi_req_entries_tail = e;
 	return e;
 }
 
-static struct ipmi_rq_entry * ipmi_req_lookup_entry(uint8_t seq, uint8_t cmd){
-	struct ipmi_rq_entry * e = ipmi_req_entries;
-	while (e && (e->rq_seq != seq || e->req.msg.cmd != cmd)) {
-		if (e->next == NULL || e == e->next)
-			return NULL;
-		e = e->next;
-	}
-	return e;
+static struct ipmi_rq_entry * ipmi_req_lookup_entry(struct ipmi_intf * intf, uint8_t seq, uint8_t cmd){
+	struct ipmi_rq_entry * e = &intf->req_entries[seq % IPMI_RQ_SEQ_MAX];
+
+	return (e->active && e->req.msg.cmd == cmd) ? e : NULL;
 }
 
-static void ipmi_req_remove_entry(uint8_t seq, uint8_t cmd){
-	struct ipmi_rq_entry * p, * e, * saved_next_entry;
+static struct ipmi_rq_entry * ipmi_req_lookup_seq(struct ipmi_intf * intf, uint8_t seq){
+	struct ipmi_rq_entry * e = &intf->req_entries[seq % IPMI_RQ_SEQ_MAX];
 
-	e = p = ipmi_req_entries;
+	return e->active ? e : NULL;
+}
 
-	while (e && (e->rq_seq != seq || e->req.msg.cmd != cmd)) {
-		p = e;
-		e = e->next;
-	}
-	if (e) {
-		saved_next_entry = e->next;
-		p->next = (p->next == e->next) ? NULL : e->next;
-		/* If entry being removed is first in list, fix up list head */
-		if (ipmi_req_entries == e) {
-			if (ipmi_req_entries != p)
-				ipmi_req_entries = p;
-			else
-				ipmi_req_entries = saved_next_entry;
-		}
-		/* If entry being removed is last in list, fix up list tail */
-		if (ipmi_req_entries_tail == e) {
-			if (ipmi_req_entries_tail != p)
-			 	ipmi_req_entries_tail = p;
-			else
-				ipmi_req_entries_tail = NULL;
-		}
-		if (e->msg_data)
-			free(e->msg_data);
-		free(e);
-	}
+static void ipmi_req_remove_entry(struct ipmi_intf * intf, uint8_t seq){
+	intf->req_entries[seq % IPMI_RQ_SEQ_MAX].active = 0;
 }
 
-static void ipmi_req_clear_entries(void)
+static void ipmi_req_clear_entries(struct ipmi_intf * intf)
 {
-	struct ipmi_rq_entry * p, * e;
-
-	e = ipmi_req_entries;
-	while (e) {
-		if (e->next != NULL) {
-			p = e->next;
-			free(e);
-			e = p;
-		} else {
-			free(e);
-			break;
-		}
-	}
-	ipmi_req_entries = NULL;
+	int i;
+
+	for (i = 0; i < IPMI_RQ_SEQ_MAX; i++)
+		ipmi_req_remove_entry(intf, i);
 }
 
 static int get_random(void *data, int len)
@@ -195,27 +189,247 @@ static int get_random(void *data, int len)
 	return rv;
 }
 
+static uint64_t ipmi_lan_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Feed one round trip sample (in us) to the session estimator and
+ * recompute the retransmission timeout, as TCP does (RFC 6298).
+ */
+static void ipmi_lan_rtt_update(struct ipmi_session * s, uint32_t rtt)
+{
+	uint32_t delta;
+
+	if (s->srtt == 0) {
+		s->srtt = rtt;
+		s->rttvar = rtt / 2;
+	} else {
+		delta = (s->srtt > rtt) ? s->srtt - rtt : rtt - s->srtt;
+		s->rttvar = (3 * s->rttvar + delta) / 4;
+		s->srtt = (7 * s->srtt + rtt) / 8;
+	}
+
+	s->rto = s->srtt + 4 * s->rttvar;
+	if (s->rto < IPMI_LAN_RTO_MIN)
+		s->rto = IPMI_LAN_RTO_MIN;
+	if (s->rto > s->timeout * 1000000)
+		s->rto = s->timeout * 1000000;
+}
+
 static int ipmi_lan_send_packet(struct ipmi_intf * intf, uint8_t * data, int data_len){
+	if (intf->sock != NULL)
+		return sendto(intf->fd, data, data_len, 0,
+			      (struct sockaddr *)&intf->session->addr, sizeof(struct sockaddr_in));
 	return send(intf->fd, data, data_len, 0);
 }
 
-static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf)
+/*
+ * Read every datagram already queued on the socket, up to
+ * IPMI_LAN_RX_BATCH, into the receive ring with a single recvmmsg().
+ * Returns the number of datagrams read, 0 or -1 like recv().
+ */
+static int ipmi_lan_recv_batch(struct ipmi_intf * intf)
+{
+	struct mmsghdr mm[IPMI_LAN_RX_BATCH];
+	struct iovec iov[IPMI_LAN_RX_BATCH];
+	int i, ret;
+
+	memset(mm, 0, sizeof(mm));
+	for (i = 0; i < IPMI_LAN_RX_BATCH; i++) {
+		iov[i].iov_base = intf->rsp[i].buf;
+		iov[i].iov_len = IPMI_BUF_SIZE - 1;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(intf->fd, mm, IPMI_LAN_RX_BATCH, MSG_DONTWAIT, NULL);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		intf->rsp[i].buf[mm[i].msg_len] = '\0';
+		intf->rsp[i].data = intf->rsp[i].buf;
+		intf->rsp[i].data_len = mm[i].msg_len;
+	}
+	intf->rx_next = 0;
+	intf->rx_count = ret;
+
+	return ret;
+}
+
+/*
+ * Session a datagram read from a shared socket belongs to: the one with
+ * the same peer and session ID. The answers received before activation
+ * (Get Channel Auth Capabilities, Get Session Challenge) carry session ID
+ * 0, so they go to the session of this peer still activating that waits
+ * for their rq_seq and command: ipmi_lan_seq_taken() keeps these rq_seq
+ * apart, for the callers of send_seq() too. Anything else, pongs included, goes to any session of the peer.
+ */
+static struct ipmi_intf * ipmi_lan_socket_lookup(struct ipmi_lan_socket * sock,
+						 struct sockaddr_in * from, uint8_t * data, int len)
+{
+	struct ipmi_intf * intf, * match = NULL;
+	uint32_t id;
+
+	for (intf = sock->intfs; intf != NULL; intf = intf->sock_next) {
+		if (intf->session->addr.sin_addr.s_addr != from->sin_addr.s_addr ||
+		    intf->session->addr.sin_port != from->sin_port)
+			continue;
+
+		if (len < 13 || data[3] != RMCP_CLASS_IPMI)
+			return intf;
+
+		memcpy(&id, data + 9, 4);
+		if (id == intf->session->session_id && intf->session->active)
+			return intf;
+		/* no auth code before activation: rq_seq at 18, command at 19 */
+		if (!intf->session->active && data[4] == IPMI_SESSION_AUTHTYPE_NONE && len > 19 &&
+		    ipmi_req_lookup_entry(intf, data[18] >> 2, data[19]) != NULL)
+			return intf;
+		if (match == NULL)
+			match = intf;
+	}
+
+	return match;
+}
+
+/*
+ * On a shared socket, is this rq_seq awaited by another session of the
+ * same peer still activating? Their answers are told apart by rq_seq.
+ */
+static int ipmi_lan_seq_taken(struct ipmi_intf * intf, uint8_t seq)
+{
+	struct ipmi_intf * q;
+
+	if (intf->sock == NULL || intf->session->active)
+		return 0;
+
+	for (q = intf->sock->intfs; q != NULL; q = q->sock_next) {
+		if (q != intf && !q->session->active &&
+		    q->session->addr.sin_addr.s_addr == intf->session->addr.sin_addr.s_addr &&
+		    q->session->addr.sin_port == intf->session->addr.sin_port &&
+		    ipmi_req_lookup_seq(q, seq) != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the datagrams queued on a shared socket and append each one to the
+ * receive ring of its session. Those of unknown peers are dropped like
+ * datagrams lost on the way, and so are those of a session whose ring is
+ * full, counted in rx_dropped: a session nobody reads must not hold back
+ * the others. Returns the number of datagrams read, 0 or -1 like recv().
+ */
+static int ipmi_lan_socket_recv(struct ipmi_lan_socket * sock)
+{
+	struct mmsghdr mm[IPMI_LAN_RX_BATCH];
+	struct iovec iov[IPMI_LAN_RX_BATCH];
+	struct sockaddr_in from[IPMI_LAN_RX_BATCH];
+	struct ipmi_intf * intf;
+	struct ipmi_rs * rsp;
+	int i, len, ret;
+
+	memset(mm, 0, sizeof(mm));
+	for (i = 0; i < IPMI_LAN_RX_BATCH; i++) {
+		iov[i].iov_base = sock->rx[i];
+		iov[i].iov_len = IPMI_BUF_SIZE - 1;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+		mm[i].msg_hdr.msg_name = &from[i];
+		mm[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	ret = recvmmsg(sock->fd, mm, IPMI_LAN_RX_BATCH, MSG_DONTWAIT, NULL);
+
+	for (i = 0; i < ret; i++) {
+		len = mm[i].msg_len;
+		intf = ipmi_lan_socket_lookup(sock, &from[i], sock->rx[i], len);
+		if (intf == NULL)
+			continue;
+
+		if (intf->rx_count == IPMI_LAN_RX_RING) {
+			sock->rx_dropped++;
+			continue;
+		}
+
+		rsp = &intf->rsp[intf->rx_count++];
+		memcpy(rsp->buf, sock->rx[i], len);
+		rsp->buf[len] = '\0';
+		rsp->data = rsp->buf;
+		rsp->data_len = len;
+	}
+
+	return ret;
+}
+
+/* Wait for one datagram of this session on a shared socket, see below */
+static struct ipmi_rs * ipmi_lan_recv_shared(struct ipmi_intf * intf, struct timeval * tmout)
+{
+	fd_set read_set;
+	int ret;
+
+	for (;;) {
+		ret = 0;
+		while (intf->rx_count == 0 && (ret = ipmi_lan_socket_recv(intf->sock)) > 0);
+		if (intf->rx_count > 0)
+			return &intf->rsp[intf->rx_next++];
+
+		if (tmout->tv_sec == 0 && tmout->tv_usec == 0)
+			return NULL;
+
+		FD_ZERO(&read_set);
+		FD_SET(intf->fd, &read_set);
+		if (select(intf->fd + 1, &read_set, NULL, NULL, tmout) <= 0)
+			return NULL;
+	}
+}
+
+/*
+ * Wait for one datagram. tmout is the remaining time budget; select()
+ * decrements it, so successive calls sharing the same timeval never wait
+ * longer than the budget in total. A zero budget only reads what is
+ * already queued, without select(), so it works for any fd number.
+ *
+ * Datagrams are read in batches: the ring is refilled only once every
+ * response of the previous batch was handed out, and each one stays
+ * valid until the next refill.
+ */
+static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf, struct timeval * tmout)
 {
-	static struct ipmi_rs rsp;
 	fd_set read_set, err_set;
-	struct timeval tmout;
 	int ret;
 
+	if (intf->rx_next < intf->rx_count)
+		return &intf->rsp[intf->rx_next++];
+	intf->rx_next = intf->rx_count = 0;
+
+	if (intf->sock != NULL)
+		return ipmi_lan_recv_shared(intf, tmout);
+
+	if (tmout->tv_sec == 0 && tmout->tv_usec == 0) {
+		ret = ipmi_lan_recv_batch(intf);
+		if (ret < 0 && errno == ECONNREFUSED)	/* see below */
+			ret = ipmi_lan_recv_batch(intf);
+		if (ret <= 0)
+			return NULL;
+
+		return &intf->rsp[intf->rx_next++];
+	}
+
 	FD_ZERO(&read_set);
 	FD_SET(intf->fd, &read_set);
 
 	FD_ZERO(&err_set);
 	FD_SET(intf->fd, &err_set);
 
-	tmout.tv_sec = intf->session->timeout;
-	tmout.tv_usec = 0;
-
-	ret = select(intf->fd + 1, &read_set, NULL, &err_set, &tmout);
+	ret = select(intf->fd + 1, &read_set, NULL, &err_set, tmout);
 	if (ret < 0 || FD_ISSET(intf->fd, &err_set) || !FD_ISSET(intf->fd, &read_set))
 		return NULL;
 
@@ -229,7 +443,7 @@ static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf)
 	 * regardless of the order they were sent out.  (unless the
 	 * response is read before the connection refused is returned)
 	 */
-	ret = recv(intf->fd, &rsp.data, IPMI_BUF_SIZE, 0);
+	ret = ipmi_lan_recv_batch(intf);
 
 	if (ret < 0) {
 		FD_ZERO(&read_set);
@@ -238,14 +452,11 @@ static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf)
 		FD_ZERO(&err_set);
 		FD_SET(intf->fd, &err_set);
 
-		tmout.tv_sec = intf->session->timeout;
-		tmout.tv_usec = 0;
-
-		ret = select(intf->fd + 1, &read_set, NULL, &err_set, &tmout);
+		ret = select(intf->fd + 1, &read_set, NULL, &err_set, tmout);
 		if (ret < 0 || FD_ISSET(intf->fd, &err_set) || !FD_ISSET(intf->fd, &read_set))
 			return NULL;
 
-		ret = recv(intf->fd, &rsp.data, IPMI_BUF_SIZE, 0);
+		ret = ipmi_lan_recv_batch(intf);
 		if (ret < 0)
 			return NULL;
 	}
@@ -253,10 +464,7 @@ static struct ipmi_rs * ipmi_lan_recv_packet(struct ipmi_intf * intf)
 	if (ret == 0)
 		return NULL;
 
-	rsp.data[ret] = '\0';
-	rsp.data_len = ret;
-
-	return &rsp;
+	return &intf->rsp[intf->rx_next++];
 }
 
 /*
@@ -328,27 +536,23 @@ static int ipmi_lan_ping(struct ipmi_intf * intf)
 		.class	= RMCP_CLASS_ASF,
 		.seq	= 0xff,
 	};
-	uint8_t * data;
-	int len = sizeof(rmcp_ping) + sizeof(asf_ping);
+	uint8_t data[sizeof(struct rmcp_hdr) + sizeof(struct asf_hdr)];
 	int rv;
+	struct timeval tmout;
 
-	data = malloc(len);
-	if (data == NULL) {
-		return -1;
-	}
-	memset(data, 0, len);
 	memcpy(data, &rmcp_ping, sizeof(rmcp_ping));
 	memcpy(data+sizeof(rmcp_ping), &asf_ping, sizeof(asf_ping));
 
-	rv = ipmi_lan_send_packet(intf, data, len);
-
-	free(data);
+	rv = ipmi_lan_send_packet(intf, data, sizeof(data));
 
 	if (rv < 0) {
 		return -1;
 	}
 
-	if (ipmi_lan_poll_recv(intf) == 0)
+	tmout.tv_sec = intf->session->timeout;
+	tmout.tv_usec = 0;
+
+	if (ipmi_lan_poll_recv(intf, &tmout) == 0)
 		return 0;
 
 	return 1;
@@ -373,25 +577,22 @@ static void ipmi_lan_thump(struct ipmi_intf * intf)
 	ipmi_lan_send_packet(intf, data, 10);
 }
 
-static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf)
+static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf, struct timeval * tmout)
 {
-	struct rmcp_hdr rmcp_rsp;
 	struct ipmi_rs * rsp;
 	struct ipmi_rq_entry * entry;
-	int x=0, rv;
-	uint8_t our_address = intf->my_addr;
+	uint8_t * d;
+	int x=0, end=0, rv, wrapped;
 
-	if (our_address == 0)
-		our_address = IPMI_BMC_SLAVE_ADDR;
-
-	rsp = ipmi_lan_recv_packet(intf);
+	rsp = ipmi_lan_recv_packet(intf, tmout);
 
 	while (rsp != NULL) {
 
-		/* parse response headers */
-		memcpy(&rmcp_rsp, rsp->data, 4);
+		/* parse response headers, in place */
+		d = rsp->buf;
+		wrapped = 0;
 
-		switch (rmcp_rsp.class) {
+		switch (d[3]) {	/* rmcp class */
 		case RMCP_CLASS_ASF:
 			/* ping response packet */
 			rv = ipmi_handle_pong(intf, rsp);
@@ -400,46 +601,47 @@ static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf)
 			/* handled by rest of function */
 			break;
 		default:
-			rsp = ipmi_lan_recv_packet(intf);
+			rsp = ipmi_lan_recv_packet(intf, tmout);
 			continue;
 		}
 
 		x = 4;
-		rsp->session.authtype = rsp->data[x++];
-		memcpy(&rsp->session.seq, rsp->data+x, 4);
+		rsp->session.authtype = d[x++];
+		memcpy(&rsp->session.seq, d+x, 4);
 		x += 4;
-		memcpy(&rsp->session.id, rsp->data+x, 4);
+		memcpy(&rsp->session.id, d+x, 4);
 		x += 4;
+		end = rsp->data_len;
 
 		if (rsp->session.id == (intf->session->session_id + 0x10000000)) {
 			/* With SOL, authtype is always NONE, so we have no authcode */
 			rsp->session.payloadtype = IPMI_PAYLOAD_TYPE_SOL;
 	
-			rsp->session.msglen = rsp->data[x++];
+			rsp->session.msglen = d[x++];
 			
 			rsp->payload.sol_packet.packet_sequence_number =
-				rsp->data[x++] & 0x0F;
+				d[x++] & 0x0F;
 
 			rsp->payload.sol_packet.acked_packet_number =
-				rsp->data[x++] & 0x0F;
+				d[x++] & 0x0F;
 
 			rsp->payload.sol_packet.accepted_character_count =
-				rsp->data[x++];
+				d[x++];
 
 			rsp->payload.sol_packet.is_nack =
-				rsp->data[x] & 0x40;
+				d[x] & 0x40;
 
 			rsp->payload.sol_packet.transfer_unavailable =
-				rsp->data[x] & 0x20;
+				d[x] & 0x20;
 
 			rsp->payload.sol_packet.sol_inactive = 
-				rsp->data[x] & 0x10;
+				d[x] & 0x10;
 
 			rsp->payload.sol_packet.transmit_overrun =
-				rsp->data[x] & 0x08;
+				d[x] & 0x08;
 	
 			rsp->payload.sol_packet.break_detected =
-				rsp->data[x++] & 0x04;
+				d[x++] & 0x04;
 
 			x++; 	
 		}
@@ -450,54 +652,72 @@ static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf)
 			if (intf->session->active && (rsp->session.authtype || intf->session->authtype))
 				x += 16;
 
-			rsp->session.msglen = rsp->data[x++];
-			rsp->payload.ipmi_response.rq_addr = rsp->data[x++];
-			rsp->payload.ipmi_response.netfn   = rsp->data[x] >> 2;
-			rsp->payload.ipmi_response.rq_lun  = rsp->data[x++] & 0x3;
+			rsp->session.msglen = d[x++];
+			end--;		/* checksum */
+ parse_msg:
+			rsp->payload.ipmi_response.rq_addr = d[x++];
+			rsp->payload.ipmi_response.netfn   = d[x] >> 2;
+			rsp->payload.ipmi_response.rq_lun  = d[x++] & 0x3;
 			x++;		/* checksum */
-			rsp->payload.ipmi_response.rs_addr = rsp->data[x++];
-			rsp->payload.ipmi_response.rq_seq  = rsp->data[x] >> 2;
-			rsp->payload.ipmi_response.rs_lun  = rsp->data[x++] & 0x3;
-			rsp->payload.ipmi_response.cmd     = rsp->data[x++];
-			rsp->ccode          = rsp->data[x++];
+			rsp->payload.ipmi_response.rs_addr = d[x++];
+			rsp->payload.ipmi_response.rq_seq  = d[x] >> 2;
+			rsp->payload.ipmi_response.rs_lun  = d[x++] & 0x3;
+			rsp->payload.ipmi_response.cmd     = d[x++];
+			rsp->ccode          = d[x++];
 			
 			/* now see if we have outstanding entry in request list */
-			entry = ipmi_req_lookup_entry(rsp->payload.ipmi_response.rq_seq,
+			entry = ipmi_req_lookup_entry(intf, rsp->payload.ipmi_response.rq_seq,
 						      rsp->payload.ipmi_response.cmd);
 			if (entry) {
-				if ((intf->target_addr != our_address) && bridge_possible) {
+				if (entry->bridging_level) {
 					
-					/* bridged command: lose extra header */
-					if (entry->bridging_level &&
-					    rsp->payload.ipmi_response.netfn == 7 &&
+					/* bridged command: skip the extra header */
+					if (rsp->payload.ipmi_response.netfn == 7 &&
 					    rsp->payload.ipmi_response.cmd == 0x34) {
+						if (end - x == 0 && rsp->ccode == IPMI_CC_CANT_RESP_DUPLI_REQ) {
+							/* a retry of a request already bridged: the answer to the first copy is on its way */
+							rsp = ipmi_lan_recv_packet(intf, tmout);
+							continue;
+						}
 						entry->bridging_level--;
-						if (rsp->data_len - x - 1 == 0) {
-							rsp = !rsp->ccode ? ipmi_lan_recv_packet(intf) : NULL;
+						if (end - x == 0) {
 							if (!entry->bridging_level)
 								entry->req.msg.cmd = entry->req.msg.target_cmd;
-							if (rsp == NULL) {
-								ipmi_req_remove_entry(entry->rq_seq, entry->req.msg.cmd);
+							if (rsp->ccode) {
+								/* Send Message refused: no answer will come, it is the answer */
+								ipmi_req_remove_entry(intf, entry->rq_seq);
+								break;
 							}
+							/* Send Message accepted: the answer comes in a later packet */
+							rsp = ipmi_lan_recv_packet(intf, tmout);
 							continue;
 						} else {
-							/* The bridged answer data are inside the incoming packet */
-							memmove(rsp->data + x - 7,
-								rsp->data + x, 
-								rsp->data_len - x - 1);
-							rsp->data[x - 8] -= 8;
-							rsp->data_len -= 8;
-							entry->rq_seq = rsp->data[x - 3] >> 2;
+							/* The bridged answer is inside the incoming packet:
+							   parse it where it lies, up to its own checksum */
+							end--;
+							/* the embedded answer carries our rq_seq back: same entry */
 							if (!entry->bridging_level)
 								entry->req.msg.cmd = entry->req.msg.target_cmd;
-							continue;
+							wrapped = 1;
+							goto parse_msg;
 						}
 					}
 				}
-				ipmi_req_remove_entry(rsp->payload.ipmi_response.rq_seq,
-						      rsp->payload.ipmi_response.cmd);
+				/* an answer to an earlier copy is on its way: keep the entry to accept it,
+				   in the same Send Message response as this one */
+				if (rsp->ccode == IPMI_CC_CANT_RESP_DUPLI_REQ) {
+					if (wrapped) {
+						entry->bridging_level++;
+						entry->req.msg.cmd = 0x34;
+					}
+				} else {
+					/* Karn: a retried request gives no usable sample */
+					if (!entry->retried)
+						ipmi_lan_rtt_update(intf->session, ipmi_lan_time_us() - entry->sent);
+					ipmi_req_remove_entry(intf, entry->rq_seq);
+				}
 			} else {
-				rsp = ipmi_lan_recv_packet(intf);
+				rsp = ipmi_lan_recv_packet(intf, tmout);
 				continue;
 			}
 		}
@@ -505,13 +725,10 @@ static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf)
 		break;
 	}
 
-	/* shift response data to start of array */
-	if (rsp && rsp->data_len > x) {
-		rsp->data_len -= x;
-		if (rsp->session.payloadtype == IPMI_PAYLOAD_TYPE_IPMI)
-			rsp->data_len -= 1; /* We don't want the checksum */
-		memmove(rsp->data, rsp->data + x, rsp->data_len);
-		memset(rsp->data + rsp->data_len, 0, IPMI_BUF_SIZE - rsp->data_len);
+	/* narrow the view to the response data, checksums excluded */
+	if (rsp) {
+		rsp->data = rsp->buf + x;
+		rsp->data_len = (end > x) ? end - x : 0;
 	}
 
 	return rsp;
@@ -545,147 +762,217 @@ static struct ipmi_rs * ipmi_lan_poll_recv(struct ipmi_intf * intf)
  * |  checksum          | 1 byte
  * +--------------------+
  */
-static struct ipmi_rq_entry * ipmi_lan_build_cmd(struct ipmi_intf * intf, struct ipmi_rq * req, int isRetry)
+static uint8_t ipmi_sum(const uint8_t * d, int s)
+{
+	uint8_t c = 0;
+	for (; s > 0; s--, d++)
+		c += *d;
+	return c;
+}
+
+/*
+ * Find or build the frame template of a request target. The header is
+ * built as for an empty request with rq_seq 0; the trailing checksums of
+ * any request then follow from the ones of that empty request, since a
+ * checksummed block together with its checksum sums to zero.
+ */
+static struct ipmi_lan_template * ipmi_lan_template(struct ipmi_intf * intf, struct ipmi_rq * req)
 {
 	struct rmcp_hdr rmcp = {
 		.ver		= RMCP_VERSION_1,
 		.class		= RMCP_CLASS_IPMI,
 		.seq		= 0xff,
 	};
-	uint8_t * msg, * temp;
-	int cs, mp, tmp;
-	int ap = 0;
+	struct ipmi_lan_template * t;
+	struct ipmi_session * s = intf->session;
+	uint8_t * msg;
+	int cs, tmp, i;
 	int len = 0;
 	int cs2 = 0, cs3 = 0;
-	struct ipmi_rq_entry * entry;
-	struct ipmi_session * s = intf->session;
-	static int curr_seq = 0;
 	uint8_t our_address = intf->my_addr;
+	uint8_t netfn_lun = req->msg.netfn << 2 | (req->msg.lun & 3);
+	uint32_t target_addr = intf->target_addr;
+	uint8_t target_channel = intf->target_channel;
+	uint32_t transit_addr = intf->transit_addr;
+	uint8_t transit_channel = intf->transit_channel;
 
 	if (our_address == 0)
 		our_address = IPMI_BMC_SLAVE_ADDR;
 
-	if (isRetry == 0)
-		curr_seq++;
-
-	if (curr_seq >= 64)
-		curr_seq = 0;
-
-	// Bug in the existing code where it keeps on adding same command/seq pair 
-	// in the lookup entry list.
-	// Check if we have cmd,seq pair already in our list. As we are not changing 
-	// the seq number we have to re-use the node which has existing
-	// command and sequence number. If we add then we will have redundant node with
-	// same cmd,seq pair
-	entry = ipmi_req_lookup_entry(curr_seq, req->msg.cmd);
-	if (entry)
-	{
-		// This indicates that we have already same command and seq in list
-		// No need to add once again and we will re-use the existing node.
-		// Only thing we have to do is clear the msg_data as we create
-		// a new one below in the code for it.
-		if (entry->msg_data)
-			free(entry->msg_data);
-	}
-	else
-	{
-		// We dont have this request in the list so we can add it 
-		// to the list
-		entry = ipmi_req_add_entry(intf, req, curr_seq);
-		if (entry == NULL)
-			return NULL;
+	/* the request may address another controller than the interface */
+	if (req->target_addr != 0) {
+		target_addr = req->target_addr;
+		target_channel = req->target_channel;
+		transit_addr = req->transit_addr;
+		transit_channel = req->transit_channel;
 	}
- 
-	len = req->msg.data_len + 29;
-	if (s->active && s->authtype)
-		len += 16;
-	if (intf->transit_addr != intf->my_addr && intf->transit_addr != 0)
-		len += 8;
-	msg = malloc(len);
-	if (msg == NULL) {
-		return NULL;
+
+	for (i = 0; i < IPMI_LAN_TEMPLATES; i++) {
+		t = &intf->templates[i];
+		if (t->valid && t->session_id == s->session_id && t->active == s->active &&
+		    t->bridge_possible == intf->bridge_possible &&
+		    t->authtype == s->authtype && t->netfn_lun == netfn_lun &&
+		    t->target_addr == target_addr && t->target_channel == target_channel &&
+		    t->transit_addr == transit_addr && t->transit_channel == transit_channel)
+			return t;
 	}
-	memset(msg, 0, len);
+
+	t = &intf->templates[intf->next_template];
+	intf->next_template = (intf->next_template + 1) % IPMI_LAN_TEMPLATES;
+
+	memset(t, 0, sizeof(struct ipmi_lan_template));
+	t->session_id = s->session_id;
+	t->active = s->active;
+	t->bridge_possible = intf->bridge_possible;
+	t->authtype = s->authtype;
+	t->netfn_lun = netfn_lun;
+	t->target_addr = target_addr;
+	t->target_channel = target_channel;
+	t->transit_addr = transit_addr;
+	t->transit_channel = transit_channel;
+	msg = t->hdr;
 
 	/* rmcp header */
 	memcpy(msg, &rmcp, sizeof(rmcp));
 	len = sizeof(rmcp);
 
-	/* ipmi session header */
+	/* ipmi session header, the session seq is set for each frame */
 	msg[len++] = s->active ? s->authtype : 0;
-
-	msg[len++] = s->in_seq & 0xff;
-	msg[len++] = (s->in_seq >> 8) & 0xff;
-	msg[len++] = (s->in_seq >> 16) & 0xff;
-	msg[len++] = (s->in_seq >> 24) & 0xff;
+	len += 4;
 	memcpy(msg+len, &s->session_id, 4);
 	len += 4;
 
 	/* ipmi session authcode */
 	if (s->active && s->authtype) {
-		ap = len;
+		t->ap = len;
 		memcpy(msg+len, s->authcode, 16);
 		len += 16;
 	}
 
 	/* message length */
-	if ((intf->target_addr == our_address) || !bridge_possible) {
-		entry->bridging_level = 0;
-		msg[len++] = req->msg.data_len + 7;
-		cs = mp = len;
+	if ((target_addr == our_address) || !intf->bridge_possible) {
+		t->bridging_level = 0;
+		t->msg_len = 7;
+		len++;
+		cs = t->mp = len;
 	} else {
 		/* bridged request: encapsulate w/in Send Message */
-		entry->bridging_level = 1;
-		msg[len++] = req->msg.data_len + 15 +
-		  (intf->transit_addr != intf->my_addr && intf->transit_addr != 0 ? 8 : 0);
-		cs = mp = len;
+		t->bridging_level = 1;
+		t->msg_len = 15 +
+		  (transit_addr != intf->my_addr && transit_addr != 0 ? 8 : 0);
+		len++;
+		cs = t->mp = len;
 		msg[len++] = IPMI_BMC_SLAVE_ADDR;
 		msg[len++] = IPMI_NETFN_APP << 2;
 		tmp = len - cs;
 		msg[len++] = ipmi_csum(msg+cs, tmp);
 		cs2 = len;
 		msg[len++] = IPMI_REMOTE_SWID;
-		msg[len++] = curr_seq << 2;
+		t->seq_off[0] = len++;
 		msg[len++] = 0x34;			/* Send Message rqst */
-		entry->req.msg.target_cmd = entry->req.msg.cmd;	/* Save target command */
-		entry->req.msg.cmd = 0x34;		/* (fixup request entry) */
 
-		if (intf->transit_addr == intf->my_addr || intf->transit_addr == 0) {
-		        msg[len++] = (0x40|intf->target_channel); /* Track request*/
+		if (transit_addr == intf->my_addr || transit_addr == 0) {
+		        msg[len++] = (0x40|target_channel); /* Track request*/
 		} else {
-		        entry->bridging_level++;
-               		msg[len++] = (0x40|intf->transit_channel); /* Track request*/
+		        t->bridging_level++;
+               		msg[len++] = (0x40|transit_channel); /* Track request*/
 			cs = len;
-			msg[len++] = intf->transit_addr;
+			msg[len++] = transit_addr;
 			msg[len++] = IPMI_NETFN_APP << 2;
 			tmp = len - cs;
 			msg[len++] = ipmi_csum(msg+cs, tmp);
 			cs3 = len;
 			msg[len++] = intf->my_addr;
-			msg[len++] = curr_seq << 2;
+			t->seq_off[1] = len++;
 			msg[len++] = 0x34;			/* Send Message rqst */
-			msg[len++] = (0x40|intf->target_channel); /* Track request */
+			msg[len++] = (0x40|target_channel); /* Track request */
 		}
 		cs = len;
 	}
 
 	/* ipmi message header */
-	msg[len++] = intf->target_addr;
-	msg[len++] = req->msg.netfn << 2 | (req->msg.lun & 3);
-	//printf("Lun : %2x \n", (req->msg.lun & 3));	//JULIAN (Debug)
+	msg[len++] = target_addr;
+	msg[len++] = netfn_lun;
 	
 	tmp = len - cs;
 	msg[len++] = ipmi_csum(msg+cs, tmp);
 	cs = len;
 
-	if (!entry->bridging_level)
+	if (!t->bridging_level)
 		msg[len++] = IPMI_REMOTE_SWID;
    /* Bridged message */ 
-	else if (entry->bridging_level) 
+	else if (t->bridging_level) 
 		msg[len++] = intf->my_addr;
-   
-	entry->rq_seq = curr_seq;
-	msg[len++] = entry->rq_seq << 2;
+
+	t->hdr_len = len;
+
+	/* checksums of the empty request, innermost first */
+	t->csum[0] = ipmi_csum(msg+cs, len - cs);
+	if (t->bridging_level == 2)
+		t->csum[1] = ipmi_csum(msg+cs3, len - cs3) - t->csum[0];
+	if (t->bridging_level)
+		t->csum[t->bridging_level] = ipmi_csum(msg+cs2, len - cs2) - t->csum[0] -
+			(t->bridging_level == 2 ? t->csum[1] : 0);
+
+	t->valid = 1;
+	return t;
+}
+
+/*
+ * Build a request frame in the buffer of its rq_seq entry: copy the
+ * template of its target, patch the few fields that change and append
+ * the request data. A payload is not copied, it is sent from where it
+ * lies (see ipmi_lan_send_entry).
+ */
+static struct ipmi_rq_entry * ipmi_lan_build_cmd(struct ipmi_intf * intf, struct ipmi_rq * req, int isRetry)
+{
+	struct ipmi_lan_template * t;
+	struct iovec iov[3];
+	uint8_t * msg;
+	uint8_t seq, sum;
+	int i, len;
+	struct ipmi_rq_entry * entry;
+	struct ipmi_session * s = intf->session;
+
+	t = ipmi_lan_template(intf, req);
+	if (t->hdr_len + 2 + req->msg.data_len + 3 > IPMI_MAX_FRAME_SIZE ||
+	    t->msg_len + req->msg.data_len + req->payload_len > 0xff)
+		return NULL;
+
+	/* a new request takes the next sequence number not already in flight */
+	for (i = 0; isRetry == 0 && i < 64; i++) {
+		intf->curr_seq = (intf->curr_seq + 1) % 64;
+		if (ipmi_req_lookup_seq(intf, intf->curr_seq) == NULL &&
+		    !ipmi_lan_seq_taken(intf, intf->curr_seq))
+			break;
+	}
+
+	// Any entry still holding this sequence number is either the previous
+	// try of this same request or a stale request that never got an answer:
+	// its slot is taken over.
+	entry = ipmi_req_add_entry(intf, req, intf->curr_seq);
+	entry->retried = isRetry;
+	entry->rq_seq = intf->curr_seq;
+	entry->bridging_level = t->bridging_level;
+	if (entry->bridging_level) {
+		entry->req.msg.target_cmd = entry->req.msg.cmd;	/* Save target command */
+		entry->req.msg.cmd = 0x34;		/* (fixup request entry) */
+	}
+	seq = entry->rq_seq << 2;
+
+	msg = entry->msg_data;
+	memcpy(msg, t->hdr, t->hdr_len);
+	len = t->hdr_len;
+
+	msg[5] = s->in_seq & 0xff;
+	msg[6] = (s->in_seq >> 8) & 0xff;
+	msg[7] = (s->in_seq >> 16) & 0xff;
+	msg[8] = (s->in_seq >> 24) & 0xff;
+	msg[t->mp - 1] = t->msg_len + req->msg.data_len + req->payload_len;
+	for (i = 0; i < t->bridging_level; i++)
+		msg[t->seq_off[i]] = seq;
+
+	msg[len++] = seq;
 	msg[len++] = req->msg.cmd;
 
 	/* message data */
@@ -693,20 +980,15 @@ static struct ipmi_rq_entry * ipmi_lan_build_cmd(struct ipmi_intf * intf, struct
  		memcpy(msg+len, req->msg.data, req->msg.data_len);
 		len += req->msg.data_len;
 	}
+	entry->msg_len = len;
 
-	/* second checksum */
-	tmp = len - cs;
-	msg[len++] = ipmi_csum(msg+cs, tmp);
-
-	/* bridged request: 2nd checksum */
-	if (entry->bridging_level) {
-		if (intf->transit_addr != intf->my_addr && intf->transit_addr != 0) {
-			tmp = len - cs3;
-			msg[len++] = ipmi_csum(msg+cs3, tmp);
-		}
-		tmp = len - cs2;
-		msg[len++] = ipmi_csum(msg+cs2, tmp);
-	}
+	/* checksums, after the payload */
+	sum = seq + req->msg.cmd + ipmi_sum(req->msg.data, req->msg.data_len) +
+		ipmi_sum(req->payload, req->payload_len);
+	msg[len++] = t->csum[0] - sum;
+	for (i = 1; i <= t->bridging_level; i++)
+		msg[len++] = t->csum[i] - seq;
+	entry->trailer_len = len - entry->msg_len;
 
 	if (s->active) {
 		/*
@@ -714,14 +996,19 @@ static struct ipmi_rq_entry * ipmi_lan_build_cmd(struct ipmi_intf * intf, struct
 		 * authtypes require portions of the ipmi message to
 		 * create the authcode so they must be done last.
 		 */
+		iov[0].iov_base = msg + t->mp;
+		iov[0].iov_len = entry->msg_len - t->mp;
+		iov[1].iov_base = req->payload;
+		iov[1].iov_len = req->payload_len;
+		iov[2].iov_base = msg + entry->msg_len;
+		iov[2].iov_len = entry->trailer_len;
+
 		switch (s->authtype) {
 		case IPMI_SESSION_AUTHTYPE_MD5:
-			temp = ipmi_auth_md5(s, msg+mp, msg[mp-1]);
-			memcpy(msg+ap, temp, 16);
+			ipmi_auth_md5_iov(s, iov, 3, msg+t->ap);
 			break;
 		case IPMI_SESSION_AUTHTYPE_MD2:
-			temp = ipmi_auth_md2(s, msg+mp, msg[mp-1]);
-			memcpy(msg+ap, temp, 16);
+			ipmi_auth_md2_iov(s, iov, 3, msg+t->ap);
 			break;
 		}
 	}
@@ -732,16 +1019,129 @@ static struct ipmi_rq_entry * ipmi_lan_build_cmd(struct ipmi_intf * intf, struct
 			s->in_seq++;
 	}
 
-	entry->msg_len = len;
-	entry->msg_data = msg;
-
 	return entry;
 }
 
+/* Frame of a built request: header and data, payload, checksums */
+static void ipmi_lan_entry_iov(struct ipmi_rq_entry * entry, struct iovec * iov, struct msghdr * mh)
+{
+	struct ipmi_intf * intf = entry->intf;
+
+	iov[0].iov_base = entry->msg_data;
+	iov[0].iov_len = entry->msg_len;
+	iov[1].iov_base = entry->req.payload;
+	iov[1].iov_len = entry->req.payload_len;
+	iov[2].iov_base = entry->msg_data + entry->msg_len;
+	iov[2].iov_len = entry->trailer_len;
+
+	memset(mh, 0, sizeof(*mh));
+	mh->msg_iov = iov;
+	mh->msg_iovlen = 3;
+	if (intf->sock != NULL) {
+		mh->msg_name = &intf->session->addr;
+		mh->msg_namelen = sizeof(struct sockaddr_in);
+	}
+}
+
+static int ipmi_lan_send_entry(struct ipmi_intf * intf, struct ipmi_rq_entry * entry)
+{
+	struct iovec iov[3];
+	struct msghdr mh;
+
+	ipmi_lan_entry_iov(entry, iov, &mh);
+
+	return sendmsg(intf->fd, &mh, 0);
+}
+
+/*
+ * Send a built request, or only queue it when batching is on: the frames
+ * queued between two flush() calls leave in one sendmmsg(). A request
+ * retried before the flush is queued once.
+ */
+static int ipmi_lan_queue_entry(struct ipmi_intf * intf, struct ipmi_rq_entry * entry)
+{
+	if (!intf->tx_batch)
+		return ipmi_lan_send_entry(intf, entry);
+
+	if (!entry->queued) {
+		if (intf->tx_count >= IPMI_RQ_SEQ_MAX && ipmi_lan_flush(intf) < 0)
+			return -1;
+		intf->tx_queue[intf->tx_count++] = entry->rq_seq;
+		entry->queued = 1;
+	}
+
+	return 0;
+}
+
+/* sendmmsg() a batch of frames, stamping each one with its send time */
+static int ipmi_lan_send_batch(int fd, struct mmsghdr * mm, struct ipmi_rq_entry ** entries, int n)
+{
+	uint64_t now;
+	int i, sent = 0, ret;
+
+	while (sent < n) {
+		ret = sendmmsg(fd, mm + sent, n - sent, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		now = ipmi_lan_time_us();
+		for (i = sent; i < sent + ret; i++)
+			entries[i]->sent = now;
+		sent += ret;
+	}
+
+	return sent;
+}
+
+/*
+ * Send every queued frame, those of all the sessions of a shared socket
+ * at once. Frames of requests cancelled since they were queued are
+ * skipped, the others are stamped with their real send time.
+ * Returns the number of frames sent, or -1 if the socket refused some:
+ * those are dropped and left to the retransmission timers.
+ */
+static int ipmi_lan_flush(struct ipmi_intf * intf)
+{
+	struct mmsghdr mm[IPMI_RQ_SEQ_MAX];
+	struct iovec iov[IPMI_RQ_SEQ_MAX][3];
+	struct ipmi_rq_entry * entries[IPMI_RQ_SEQ_MAX];
+	struct ipmi_intf * q;
+	int i, n = 0, sent = 0, ret;
+
+	q = (intf->sock != NULL) ? intf->sock->intfs : intf;
+	for (; q != NULL; q = (intf->sock != NULL) ? q->sock_next : NULL) {
+		for (i = 0; i < q->tx_count; i++) {
+			struct ipmi_rq_entry * e = &q->req_entries[q->tx_queue[i]];
+
+			if (!e->active || !e->queued)
+				continue;
+			e->queued = 0;
+
+			if (n == IPMI_RQ_SEQ_MAX) {
+				ret = ipmi_lan_send_batch(intf->fd, mm, entries, n);
+				sent = (ret < 0 || sent < 0) ? -1 : sent + ret;
+				n = 0;
+			}
+			ipmi_lan_entry_iov(e, iov[n], &mm[n].msg_hdr);
+			entries[n++] = e;
+		}
+		q->tx_count = 0;
+	}
+
+	ret = ipmi_lan_send_batch(intf->fd, mm, entries, n);
+
+	return (ret < 0 || sent < 0) ? -1 : sent + ret;
+}
+
 static struct ipmi_rs * ipmi_lan_send_cmd(struct ipmi_intf * intf, struct ipmi_rq * req)
 {
 	struct ipmi_rq_entry * entry;
 	struct ipmi_rs * rsp = NULL;
+	struct ipmi_session * s = intf->session;
+	struct timeval tmout;
+	uint64_t rto;
 	int try = 0;
 	int isRetry = 0;
 
@@ -751,6 +1151,13 @@ static struct ipmi_rs * ipmi_lan_send_cmd(struct ipmi_intf * intf, struct ipmi_r
 		}
 	}
 
+	/*
+	 * Wait one retransmission timeout for the answer, doubling it on every
+	 * retry. Without retries the whole session timeout is given to the
+	 * only attempt.
+	 */
+	rto = (s->retry == -1) ? (uint64_t)s->timeout * 1000000 : s->rto;
+
 	for (;;) {
 		isRetry = ( try > 0 ) ? 1 : 0;
 
@@ -759,63 +1166,138 @@ static struct ipmi_rs * ipmi_lan_send_cmd(struct ipmi_intf * intf, struct ipmi_r
 			return NULL;
 		}
 
-		if (ipmi_lan_send_packet(intf, entry->msg_data, entry->msg_len) < 0) {
-			try++;
-			usleep(5000);
-			ipmi_req_remove_entry(entry->rq_seq, entry->req.msg.target_cmd);	
+		/* waited for right away: never left in the queue of tx_batch */
+		if (ipmi_lan_send_entry(intf, entry) < 0) {
+			ipmi_req_remove_entry(intf, entry->rq_seq);
+			if (++try >= s->retry)
+				break;
 			continue;
 		}
+		entry->sent = ipmi_lan_time_us();
 
-		usleep(100);
-
-		rsp = ipmi_lan_poll_recv(intf);
+		tmout.tv_sec = rto / 1000000;
+		tmout.tv_usec = rto % 1000000;
+		rsp = ipmi_lan_poll_recv(intf, &tmout);
 
 		/* Duplicate Request ccode most likely indicates a response to
-		   a previous retry. Ignore and keep polling. */
+		   a previous retry. Ignore and keep polling for what is left
+		   of the timeout. */
 		if((rsp != NULL) && (rsp->ccode == 0xcf)) {
 			rsp = NULL;
-			rsp = ipmi_lan_poll_recv(intf);
+			rsp = ipmi_lan_poll_recv(intf, &tmout);
 		}
 		
 		if (rsp)
 			break;
 
-		usleep(5000);
-		if (++try >= intf->session->retry) {
-			if(intf->session->retry == -1){
+		if (++try >= s->retry) {
+			if(s->retry == -1){
 				fprintf(stderr, "Retries are disabled.\n");
 			}
 			break;
 		}
+
+		rto *= 2;
+		if (rto > (uint64_t)s->timeout * 1000000)
+			rto = (uint64_t)s->timeout * 1000000;
 	}
 
-	// We need to cleanup the existing entries from the list. Because if we 
-	// keep it and then when we send the new command and if the response is for
-	// old command it still matches it and then returns success.
-	// This is the corner case where the remote controller responds very slowly.
-	//
-	// Example: We have to send command 23 and 2d.
-	// If we send command,seq as 23,10 and if we dont get any response it will 
-	// retry 4 times with 23,10 and then come out here and indicate that there is no
-	// reponse from the remote controller and will send the next command for 
-	// ie 2d,11. And if the BMC is slow to respond and returns 23,10 then it 
-	// will match it in the list and will take response of command 23 as response 
-	// for command 2d and return success. So ideally when retries are done and 
-	// are out of this function we should be clearing the list to be safe so that
-	// we dont match the old response with new request.
-	//          [23, 10] --> BMC
-	//          [23, 10] --> BMC
+	// Retire this request: if the remote controller answers it late, the
+	// response must not be taken for the answer to a later request reusing
+	// the seq. Only its own entry goes, other requests may still be in flight.
 	//          [23, 10] --> BMC
 	//          [23, 10] --> BMC
 	//          [2D, 11] --> BMC
-	//                   <-- [23, 10]
-	//  here if we maintain 23,10 in the list then it will get matched and consider
-	//  23 response as response for 2D.   
-	ipmi_req_clear_entries();
- 
+	//                   <-- [23, 10]   (dropped, no entry)
+	if (entry != NULL && entry->active)
+		ipmi_req_remove_entry(intf, entry->rq_seq);
+
 	return rsp;
 }
 
+/*
+ * Send a request without waiting for its response.
+ *
+ * The request stays in the outstanding list until its response is
+ * returned by ipmi_lan_recv_async() or it is dropped with
+ * ipmi_lan_cancel(), so several requests can be in flight at once.
+ * Returns the rq_seq used for the request, or -1 on error.
+ */
+static int ipmi_lan_send_async(struct ipmi_intf * intf, struct ipmi_rq * req)
+{
+	struct ipmi_rq_entry * entry;
+
+	if (intf->opened == 0 && intf->open != NULL) {
+		if (intf->open(intf) < 0) {
+			return -1;
+		}
+	}
+
+	entry = ipmi_lan_build_cmd(intf, req, 0);
+	if (entry == NULL) {
+		return -1;
+	}
+
+	if (ipmi_lan_send_entry(intf, entry) < 0) {
+		ipmi_req_remove_entry(intf, entry->rq_seq);
+		return -1;
+	}
+	entry->sent = ipmi_lan_time_us();
+
+	return entry->rq_seq;
+}
+
+/*
+ * Wait up to timeout_us for the response to any outstanding request.
+ * The request it answers is given by rsp->payload.ipmi_response.rq_seq.
+ */
+static struct ipmi_rs * ipmi_lan_recv_async(struct ipmi_intf * intf, unsigned long timeout_us)
+{
+	struct timeval tmout;
+
+	if (intf->opened == 0)
+		return NULL;
+
+	tmout.tv_sec = timeout_us / 1000000;
+	tmout.tv_usec = timeout_us % 1000000;
+
+	return ipmi_lan_poll_recv(intf, &tmout);
+}
+
+/*
+ * Send a request with a sequence number chosen by the caller, who then
+ * owns the rq_seq space of this session. A retry reuses the seq of the
+ * previous copy, so an answer to any of them is accepted.
+ */
+static int ipmi_lan_send_seq(struct ipmi_intf * intf, struct ipmi_rq * req, uint8_t seq, int retry)
+{
+	struct ipmi_rq_entry * entry;
+
+	intf->curr_seq = seq;
+	entry = ipmi_lan_build_cmd(intf, req, 1);
+	if (entry == NULL) {
+		return -1;
+	}
+	entry->retried = retry;
+
+	if (ipmi_lan_queue_entry(intf, entry) < 0) {
+		ipmi_req_remove_entry(intf, entry->rq_seq);
+		return -1;
+	}
+	entry->sent = ipmi_lan_time_us();
+
+	return entry->rq_seq;
+}
+
+/* Forget an outstanding request: a late response to it will be ignored */
+static void ipmi_lan_cancel(struct ipmi_intf * intf, uint8_t seq)
+{
+	struct ipmi_rq_entry * e = ipmi_req_lookup_seq(intf, seq);
+
+	if (e != NULL)
+		ipmi_req_remove_entry(intf, e->rq_seq);
+}
+
 static uint8_t * ipmi_lan_build_rsp(struct ipmi_intf * intf, struct ipmi_rs * rsp, int * llen){
 	struct rmcp_hdr rmcp = {
 		.ver	= RMCP_VERSION_1,
@@ -889,15 +1371,12 @@ static uint8_t * ipmi_lan_build_rsp(struct ipmi_intf * intf, struct ipmi_rs * rs
 	msg[len++] = ipmi_csum(msg+cs, tmp);
 
 	if (s->active) {
-		uint8_t * d;
 		switch (s->authtype) {
 		case IPMI_SESSION_AUTHTYPE_MD5:
-			d = ipmi_auth_md5(s, msg+mp, msg[mp-1]);
-			memcpy(msg+ap, d, 16);
+			ipmi_auth_md5(s, msg+mp, msg[mp-1], msg+ap);
 			break;
 		case IPMI_SESSION_AUTHTYPE_MD2:
-			d = ipmi_auth_md2(s, msg+mp, msg[mp-1]);
-			memcpy(msg+ap, d, 16);
+			ipmi_auth_md2(s, msg+mp, msg[mp-1], msg+ap);
 			break;
 		}
 	}
@@ -928,67 +1407,109 @@ ipmi_lan_keepalive(struct ipmi_intf * intf)
 	return 0;
 }
 
-/*
- * IPMI Get Channel Authentication Capabilities Command
- */
-static int ipmi_get_auth_capabilities_cmd(struct ipmi_intf * intf)
+/* Cached capabilities of the BMC of a session, see struct ipmi_lan_caps */
+static struct ipmi_lan_caps * ipmi_lan_caps_lookup(struct ipmi_intf * intf)
 {
-	struct ipmi_rs * rsp;
-	struct ipmi_rq req;
+	struct ipmi_lan_caps_cache * cache = intf->caps;
 	struct ipmi_session * s = intf->session;
-	uint8_t msg_data[2];
-
-	msg_data[0] = IPMI_LAN_CHANNEL_E;
-	msg_data[1] = s->privlvl;
+	struct ipmi_lan_caps * c;
+	int i;
 
-	memset(&req, 0, sizeof(req));
-	req.msg.netfn    = IPMI_NETFN_APP;
-	req.msg.cmd      = 0x38;
-	req.msg.data     = msg_data;
-	req.msg.data_len = 2;
+	if (cache == NULL)
+		return NULL;
 
-	rsp = intf->sendrecv(intf, &req);
-	if (rsp == NULL) {
-		return -1;
+	for (i = 0; i < cache->count; i++) {
+		c = &cache->entries[i];
+		if (c->addr.sin_addr.s_addr == s->addr.sin_addr.s_addr &&
+		    c->addr.sin_port == s->addr.sin_port &&
+		    c->privlvl == s->privlvl)
+			return c;
 	}
+	return NULL;
+}
 
-	if (rsp->ccode > 0) {
-		return -1;
+static void ipmi_lan_caps_save(struct ipmi_intf * intf, uint8_t authtypes)
+{
+	struct ipmi_lan_caps_cache * cache = intf->caps;
+	struct ipmi_session * s = intf->session;
+	struct ipmi_lan_caps * c = ipmi_lan_caps_lookup(intf);
+
+	if (cache == NULL)
+		return;
+
+	if (c == NULL) {
+		if (cache->count < IPMI_LAN_CAPS_CACHE) {
+			c = &cache->entries[cache->count++];
+		} else {
+			c = &cache->entries[cache->next];
+			cache->next = (cache->next + 1) % IPMI_LAN_CAPS_CACHE;
+		}
+		memset(c, 0, sizeof(struct ipmi_lan_caps));
+		c->addr = s->addr;
+		c->privlvl = s->privlvl;
 	}
+	c->authtypes = authtypes;
+	c->authstatus = s->authstatus;
+}
 
-	s->authstatus = rsp->data[2];
+/* Keep the round trip estimate of a session for the next one to its BMC */
+static void ipmi_lan_caps_save_rtt(struct ipmi_intf * intf)
+{
+	struct ipmi_session * s = intf->session;
+	struct ipmi_lan_caps * c = ipmi_lan_caps_lookup(intf);
 
+	if (c == NULL || s->srtt == 0)
+		return;
+	c->srtt = s->srtt;
+	c->rttvar = s->rttvar;
+	c->rto = s->rto;
+}
+
+static void ipmi_lan_caps_forget(struct ipmi_intf * intf)
+{
+	struct ipmi_lan_caps * c = ipmi_lan_caps_lookup(intf);
+
+	if (c != NULL)
+		c->privlvl = 0;		/* never requested: the entry matches no session */
+}
+
+/*
+ * Pick the session authentication type among those the BMC supports,
+ * strongest first.
+ */
+static int ipmi_lan_select_authtype(struct ipmi_session * s, uint8_t authtypes)
+{
 	if (s->password &&
 	    (s->authtype_set == 0 ||
 	     s->authtype_set == IPMI_SESSION_AUTHTYPE_MD5) &&
-	    (rsp->data[1] & 1<<IPMI_SESSION_AUTHTYPE_MD5))
+	    (authtypes & 1<<IPMI_SESSION_AUTHTYPE_MD5))
 	{
 		s->authtype = IPMI_SESSION_AUTHTYPE_MD5;
 	}
 	else if (s->password &&
 		 (s->authtype_set == 0 ||
 		  s->authtype_set == IPMI_SESSION_AUTHTYPE_MD2) &&
-		 (rsp->data[1] & 1<<IPMI_SESSION_AUTHTYPE_MD2))
+		 (authtypes & 1<<IPMI_SESSION_AUTHTYPE_MD2))
 	{
 		s->authtype = IPMI_SESSION_AUTHTYPE_MD2;
 	}
 	else if (s->password &&
 		 (s->authtype_set == 0 ||
 		  s->authtype_set == IPMI_SESSION_AUTHTYPE_PASSWORD) &&
-		 (rsp->data[1] & 1<<IPMI_SESSION_AUTHTYPE_PASSWORD))
+		 (authtypes & 1<<IPMI_SESSION_AUTHTYPE_PASSWORD))
 	{
 		s->authtype = IPMI_SESSION_AUTHTYPE_PASSWORD;
 	}
 	else if (s->password &&
 		 (s->authtype_set == 0 ||
 		  s->authtype_set == IPMI_SESSION_AUTHTYPE_OEM) &&
-		 (rsp->data[1] & 1<<IPMI_SESSION_AUTHTYPE_OEM))
+		 (authtypes & 1<<IPMI_SESSION_AUTHTYPE_OEM))
 	{
 		s->authtype = IPMI_SESSION_AUTHTYPE_OEM;
 	}
 	else if ((s->authtype_set == 0 ||
 		  s->authtype_set == IPMI_SESSION_AUTHTYPE_NONE) &&
-		 (rsp->data[1] & 1<<IPMI_SESSION_AUTHTYPE_NONE))
+		 (authtypes & 1<<IPMI_SESSION_AUTHTYPE_NONE))
 	{
 		s->authtype = IPMI_SESSION_AUTHTYPE_NONE;
 	}
@@ -999,33 +1520,68 @@ static int ipmi_get_auth_capabilities_cmd(struct ipmi_intf * intf)
 	return 0;
 }
 
+/*
+ * IPMI Get Channel Authentication Capabilities Command
+ */
+static void ipmi_get_auth_capabilities_req(struct ipmi_intf * intf, struct ipmi_rq * req)
+{
+	struct ipmi_session * s = intf->session;
+
+	s->hs_data[0] = IPMI_LAN_CHANNEL_E;
+	s->hs_data[1] = s->privlvl;
+
+	req->msg.netfn    = IPMI_NETFN_APP;
+	req->msg.cmd      = 0x38;
+	req->msg.data_len = 2;
+}
+
+static int ipmi_get_auth_capabilities_rsp(struct ipmi_intf * intf, struct ipmi_rs * rsp)
+{
+	struct ipmi_session * s = intf->session;
+
+	if (rsp == NULL) {
+		return -1;
+	}
+
+	if (rsp->ccode > 0 || rsp->data_len < 3) {
+		return -1;
+	}
+
+	s->authstatus = rsp->data[2];
+
+	if (ipmi_lan_select_authtype(s, rsp->data[1]) < 0)
+		return -1;
+
+	ipmi_lan_caps_save(intf, rsp->data[1]);
+	return 0;
+}
+
 /*
  * IPMI Get Session Challenge Command
  * returns a temporary session ID and 16 byte challenge string
  */
-static int ipmi_get_session_challenge_cmd(struct ipmi_intf * intf)
+static void ipmi_get_session_challenge_req(struct ipmi_intf * intf, struct ipmi_rq * req)
 {
-	struct ipmi_rs * rsp;
-	struct ipmi_rq req;
 	struct ipmi_session * s = intf->session;
-	uint8_t msg_data[17];
 
-	memset(msg_data, 0, 17);
-	msg_data[0] = s->authtype;
-	memcpy(msg_data+1, s->username, 16);
+	memset(s->hs_data, 0, 17);
+	s->hs_data[0] = s->authtype;
+	memcpy(s->hs_data+1, s->username, 16);
+
+	req->msg.netfn		= IPMI_NETFN_APP;
+	req->msg.cmd		= 0x39;
+	req->msg.data_len	= 17; /* 1 byte for authtype, 16 for user */
+}
 
-	memset(&req, 0, sizeof(req));
-	req.msg.netfn		= IPMI_NETFN_APP;
-	req.msg.cmd		= 0x39;
-	req.msg.data		= msg_data;
-	req.msg.data_len	= 17; /* 1 byte for authtype, 16 for user */
+static int ipmi_get_session_challenge_rsp(struct ipmi_intf * intf, struct ipmi_rs * rsp)
+{
+	struct ipmi_session * s = intf->session;
 
-	rsp = intf->sendrecv(intf, &req);
 	if (rsp == NULL) {
 		return -1;
 	}
 
-	if (rsp->ccode > 0) {
+	if (rsp->ccode > 0 || rsp->data_len < 20) {
 		return -1;
 	}
 
@@ -1038,38 +1594,34 @@ static int ipmi_get_session_challenge_cmd(struct ipmi_intf * intf)
 /*
  * IPMI Activate Session Command
  */
-static int ipmi_activate_session_cmd(struct ipmi_intf * intf)
+static void ipmi_activate_session_req(struct ipmi_intf * intf, struct ipmi_rq * req)
 {
-	struct ipmi_rs * rsp;
-	struct ipmi_rq req;
 	struct ipmi_session * s = intf->session;
-	uint8_t msg_data[22];
 
-	memset(&req, 0, sizeof(req));
-	req.msg.netfn = IPMI_NETFN_APP;
-	req.msg.cmd = 0x3a;
+	req->msg.netfn = IPMI_NETFN_APP;
+	req->msg.cmd = 0x3a;
 
-	msg_data[0] = s->authtype;
-	msg_data[1] = s->privlvl;
+	s->hs_data[0] = s->authtype;
+	s->hs_data[1] = s->privlvl;
 
+	memcpy(s->hs_data + 2, s->challenge, 16);
 
-	memcpy(msg_data + 2, s->challenge, 16);
-		
 	/* setup initial outbound sequence number */
-	get_random(msg_data+18, 4);
+	get_random(s->hs_data+18, 4);
 
-	req.msg.data = msg_data;
-	req.msg.data_len = 22;
+	req->msg.data_len = 22;
 
 	s->active = 1;
+}
 
-	rsp = intf->sendrecv(intf, &req);
-	if (rsp == NULL) {
-		s->active = 0;
-		return -1;
-	}
+static int ipmi_activate_session_rsp(struct ipmi_intf * intf, struct ipmi_rs * rsp)
+{
+	struct ipmi_session * s = intf->session;
 
-	if (rsp->ccode) {
+	/* not activated: close() has nothing to send */
+	if (rsp == NULL || rsp->ccode || rsp->data_len < 9) {
+		s->active = 0;
+		intf->bridge_possible = 0;
 		return -1;
 	}
 
@@ -1084,34 +1636,28 @@ static int ipmi_activate_session_cmd(struct ipmi_intf * intf)
 		return -1;
 	}
 
-	bridge_possible = 1;
-	
 	return 0;
 }
 
 
 /*
  * IPMI Set Session Privilege Level Command
+ * Not a bridge message: bridging is only allowed once it succeeded.
  */
-static int ipmi_set_session_privlvl_cmd(struct ipmi_intf * intf)
+static void ipmi_set_session_privlvl_req(struct ipmi_intf * intf, struct ipmi_rq * req)
 {
-	struct ipmi_rs * rsp;
-	struct ipmi_rq req;
-	uint8_t privlvl = intf->session->privlvl;
-	uint8_t backup_bridge_possible = bridge_possible;
+	struct ipmi_session * s = intf->session;
 
-	if (privlvl <= IPMI_SESSION_PRIV_USER)
-		return 0;	/* no need to set higher */
+	s->hs_data[0] = s->privlvl;
 
-	memset(&req, 0, sizeof(req));
-	req.msg.netfn		= IPMI_NETFN_APP;
-	req.msg.cmd		= 0x3b;
-	req.msg.data		= &privlvl;
-	req.msg.data_len	= 1;
+	req->msg.netfn		= IPMI_NETFN_APP;
+	req->msg.cmd		= 0x3b;
+	req->msg.data_len	= 1;
+}
 
-	bridge_possible = 0;
-	rsp = intf->sendrecv(intf, &req);
-	bridge_possible = backup_bridge_possible;
+static int ipmi_set_session_privlvl_rsp(struct ipmi_intf * intf, struct ipmi_rs * rsp)
+{
+	(void)intf;
 
 	if (rsp == NULL) {
 		return -1;
@@ -1124,26 +1670,35 @@ static int ipmi_set_session_privlvl_cmd(struct ipmi_intf * intf)
 	return 0;
 }
 
+/* Close Session request, its data in hs_data like the handshake ones */
+static int ipmi_close_session_req(struct ipmi_intf * intf, struct ipmi_rq * req)
+{
+	struct ipmi_session * s = intf->session;
+
+	if (s == NULL || s->active == 0)
+		return -1;
+
+	memcpy(s->hs_data, &s->session_id, 4);
+
+	memset(req, 0, sizeof(struct ipmi_rq));
+	req->msg.netfn		= IPMI_NETFN_APP;
+	req->msg.cmd		= 0x3c;
+	req->msg.data		= s->hs_data;
+	req->msg.data_len	= 4;
+
+	return 0;
+}
+
 static int ipmi_close_session_cmd(struct ipmi_intf * intf)
 {
 	struct ipmi_rs * rsp;
 	struct ipmi_rq req;
-	uint8_t msg_data[4];
-	uint32_t session_id = intf->session->session_id;
 
-	if (intf->session->active == 0)
+	if (ipmi_close_session_req(intf, &req) < 0)
 		return -1;
 
 	intf->target_addr = IPMI_BMC_SLAVE_ADDR;
-	bridge_possible = 0;  /* Not a bridge message */
-
-	memcpy(&msg_data, &session_id, 4);
-
-	memset(&req, 0, sizeof(req));
-	req.msg.netfn		= IPMI_NETFN_APP;
-	req.msg.cmd		= 0x3c;
-	req.msg.data		= msg_data;
-	req.msg.data_len	= 4;
+	intf->bridge_possible = 0;  /* Not a bridge message */
 
 	rsp = intf->sendrecv(intf, &req);
 	if (rsp == NULL) {
@@ -1160,6 +1715,34 @@ static int ipmi_close_session_cmd(struct ipmi_intf * intf)
 	return 0;
 }
 
+/* Build the request of the current handshake step */
+static int ipmi_lan_handshake_req(struct ipmi_intf * intf, struct ipmi_rq * req)
+{
+	struct ipmi_session * s = intf->session;
+
+	memset(req, 0, sizeof(struct ipmi_rq));
+	req->msg.data = s->hs_data;
+
+	switch (s->hs_state) {
+	case IPMI_LAN_HS_CAPS:
+		ipmi_get_auth_capabilities_req(intf, req);
+		break;
+	case IPMI_LAN_HS_CHALLENGE:
+		ipmi_get_session_challenge_req(intf, req);
+		break;
+	case IPMI_LAN_HS_ACTIVATE:
+		ipmi_activate_session_req(intf, req);
+		break;
+	case IPMI_LAN_HS_PRIVLVL:
+		ipmi_set_session_privlvl_req(intf, req);
+		break;
+	default:
+		return -1;
+	}
+
+	return IPMI_HANDSHAKE_SEND;
+}
+
 /*
  * IPMI LAN Session Activation (IPMI spec v1.5 section 12.9)
  *
@@ -1176,52 +1759,151 @@ static int ipmi_close_session_cmd(struct ipmi_intf * intf)
  *    the outbound sequence number for BMC.
  * 5. BMC returns response confirming session activation and
  *    session ID for this session and initial inbound sequence.
+ *
+ * One step per call, so that the caller decides how the requests are
+ * sent: rsp answers the request of the previous call (NULL: it was never
+ * answered), the first call of a session starts the handshake. Step 2 is
+ * skipped when the capabilities of the BMC are cached.
  */
-static int ipmi_lan_activate_session(struct ipmi_intf * intf)
+static int ipmi_lan_handshake(struct ipmi_intf * intf, struct ipmi_rs * rsp, struct ipmi_rq * req)
 {
-	int rc;
+	struct ipmi_session * s = intf->session;
+	struct ipmi_lan_caps * c;
 
 	/* don't fail on ping because its not always supported.
 	 * Supermicro's IPMI LAN 1.5 cards don't tolerate pings.
 	 */
 
-	rc = ipmi_get_auth_capabilities_cmd(intf);
-	if (rc < 0) {
-		sleep(1);
-		rc = ipmi_get_auth_capabilities_cmd(intf);
-		if (rc < 0)
-			goto fail;
-	}
+	switch (s->hs_state) {
+	case IPMI_LAN_HS_START:
+		c = ipmi_lan_caps_lookup(intf);
+		if (c != NULL && c->srtt != 0 && s->srtt == 0) {
+			s->srtt = c->srtt;
+			s->rttvar = c->rttvar;
+			s->rto = c->rto;
+		}
+		s->hs_tries = 0;
+		s->hs_cached = 0;
+		s->hs_state = IPMI_LAN_HS_CAPS;
+		if (c != NULL) {
+			s->authstatus = c->authstatus;
+			if (ipmi_lan_select_authtype(s, c->authtypes) == 0) {
+				s->hs_cached = 1;
+				s->hs_state = IPMI_LAN_HS_CHALLENGE;
+			}
+		}
+		return ipmi_lan_handshake_req(intf, req);
+
+	case IPMI_LAN_HS_CAPS:
+		if (ipmi_get_auth_capabilities_rsp(intf, rsp) < 0) {
+			/* once more, after a round trip time */
+			if (s->hs_tries++ > 0)
+				break;
+			ipmi_lan_handshake_req(intf, req);
+			return IPMI_HANDSHAKE_RETRY;
+		}
+		s->hs_state = IPMI_LAN_HS_CHALLENGE;
+		return ipmi_lan_handshake_req(intf, req);
+
+	case IPMI_LAN_HS_CHALLENGE:
+		if (ipmi_get_session_challenge_rsp(intf, rsp) < 0) {
+			/* the BMC may have been reconfigured since it was cached */
+			if (!s->hs_cached)
+				break;
+			ipmi_lan_caps_forget(intf);
+			s->hs_cached = 0;
+			s->hs_state = IPMI_LAN_HS_CAPS;
+			return ipmi_lan_handshake_req(intf, req);
+		}
+		s->hs_state = IPMI_LAN_HS_ACTIVATE;
+		return ipmi_lan_handshake_req(intf, req);
 
-	rc = ipmi_get_session_challenge_cmd(intf);
-	if (rc < 0)
-		goto fail;
+	case IPMI_LAN_HS_ACTIVATE:
+		if (ipmi_activate_session_rsp(intf, rsp) < 0)
+			break;
+		intf->abort = 0;
+		if (s->privlvl > IPMI_SESSION_PRIV_USER) {
+			s->hs_state = IPMI_LAN_HS_PRIVLVL;
+			return ipmi_lan_handshake_req(intf, req);
+		}
+		goto done;	/* no need to set higher */
 
-	rc = ipmi_activate_session_cmd(intf);
-	if (rc < 0)
-		goto fail;
+	case IPMI_LAN_HS_PRIVLVL:
+		if (ipmi_set_session_privlvl_rsp(intf, rsp) < 0)
+			break;
+		goto done;
 
-	intf->abort = 0;
+	default:
+		break;
+	}
 
-	rc = ipmi_set_session_privlvl_cmd(intf);
-	if (rc < 0)
-		goto fail;
+	s->hs_state = IPMI_LAN_HS_FAILED;
+	return -1;
 
+ done:
+	s->hs_state = IPMI_LAN_HS_DONE;
+	intf->bridge_possible = 1;
+	ipmi_lan_caps_save_rtt(intf);
 	return 0;
+}
 
- fail:
-	return -1;
+/*
+ * Wait us on the socket of the session rather than sleeping: what comes
+ * meanwhile is read, and a late answer to a retired request is dropped.
+ */
+static void ipmi_lan_wait(struct ipmi_intf * intf, uint64_t us)
+{
+	struct timeval tmout;
+	uint64_t now, end;
+
+	end = ipmi_lan_time_us() + us;
+	while ((now = ipmi_lan_time_us()) < end) {
+		tmout.tv_sec = (end - now) / 1000000;
+		tmout.tv_usec = (end - now) % 1000000;
+		ipmi_lan_poll_recv(intf, &tmout);
+	}
+}
+
+/* Run the whole handshake, waiting for each answer */
+static int ipmi_lan_activate_session(struct ipmi_intf * intf)
+{
+	struct ipmi_rs * rsp;
+	struct ipmi_rq req;
+	int rc;
+
+	rc = ipmi_lan_handshake(intf, NULL, &req);
+	while (rc > 0) {
+		if (rc == IPMI_HANDSHAKE_RETRY)
+			ipmi_lan_wait(intf, intf->session->rto);
+		rsp = intf->sendrecv(intf, &req);
+		rc = ipmi_lan_handshake(intf, rsp, &req);
+	}
+
+	return rc;
 }
 
 static void ipmi_lan_close(struct ipmi_intf * intf)
 {
-	if (intf->abort == 0)
+	if (intf->abort == 0) {
+		ipmi_lan_caps_save_rtt(intf);
 		ipmi_close_session_cmd(intf);
+	}
+
+	if (intf->sock != NULL) {
+		struct ipmi_intf ** p;
 
-	if (intf->fd >= 0)
+		for (p = &intf->sock->intfs; *p != NULL; p = &(*p)->sock_next) {
+			if (*p == intf) {
+				*p = intf->sock_next;
+				break;
+			}
+		}
+	} else if (intf->fd >= 0) {
 		close(intf->fd);
+	}
+	intf->fd = -1;
 
-	ipmi_req_clear_entries();
+	ipmi_req_clear_entries(intf);
 
 	if (intf->session != NULL) {
 		free(intf->session);
@@ -1232,7 +1914,11 @@ static void ipmi_lan_close(struct ipmi_intf * intf)
 	intf = NULL;
 }
 
-static int ipmi_lan_open(struct ipmi_intf * intf)
+/*
+ * Set the session defaults and open the socket to the BMC: the session
+ * still has to be activated, with ipmi_lan_handshake().
+ */
+static int ipmi_lan_connect(struct ipmi_intf * intf)
 {
 	int rc;
 	struct ipmi_session *s;
@@ -1250,6 +1936,10 @@ static int ipmi_lan_open(struct ipmi_intf * intf)
 		s->timeout = IPMI_LAN_TIMEOUT;
 	if (s->retry == 0)
 		s->retry = IPMI_LAN_RETRY;
+	if (s->rto == 0)
+		s->rto = IPMI_LAN_RTO_INIT;
+	if (s->inactivity == 0)
+		s->inactivity = IPMI_LAN_INACTIVITY;
 
 	if (s->hostname == NULL || strlen((const char *)s->hostname) == 0) {
 		return -1;
@@ -1274,19 +1964,37 @@ static int ipmi_lan_open(struct ipmi_intf * intf)
 		memcpy(&s->addr.sin_addr, host->h_addr, host->h_length);
 	}
 
-	intf->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (intf->fd < 0) {
-		return -1;
-	}
+	if (intf->sock != NULL) {
+		/* shared socket: datagrams are addressed and routed per session */
+		intf->fd = intf->sock->fd;
+		intf->sock_next = intf->sock->intfs;
+		intf->sock->intfs = intf;
+	} else {
+		intf->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (intf->fd < 0) {
+			return -1;
+		}
 
-	/* connect to UDP socket so we get async errors */
-	rc = connect(intf->fd, (struct sockaddr *)&s->addr, sizeof(struct sockaddr_in));
-	if (rc < 0) {
-		intf->close(intf);
-		return -1;
+		/* connect to UDP socket so we get async errors */
+		rc = connect(intf->fd, (struct sockaddr *)&s->addr, sizeof(struct sockaddr_in));
+		if (rc < 0) {
+			intf->close(intf);
+			return -1;
+		}
 	}
 
 	intf->opened = 1;
+	s->hs_state = IPMI_LAN_HS_START;
+
+	return intf->fd;
+}
+
+static int ipmi_lan_open(struct ipmi_intf * intf)
+{
+	int rc;
+
+	if (ipmi_lan_connect(intf) < 0)
+		return -1;
 
 	/* try to open session */
 	rc = ipmi_lan_activate_session(intf);
@@ -1306,5 +2014,66 @@ static int ipmi_lan_setup(struct ipmi_intf * intf)
 		return -1;
 	}
 	memset(intf->session, 0, sizeof(struct ipmi_session));
+
+	intf->fd = -1;
+	memset(intf->req_entries, 0, sizeof(intf->req_entries));
+	memset(intf->templates, 0, sizeof(intf->templates));
+	intf->next_template = 0;
+	intf->bridge_possible = 0;
+	intf->curr_seq = 0;
+	intf->rx_next = intf->rx_count = 0;
+	intf->tx_batch = intf->tx_count = 0;
+	intf->sock = NULL;
+	intf->sock_next = NULL;
+	intf->caps = NULL;
 	return 0;
 }
+
+/*
+ * Socket to share between sessions: set intf->sock before they are
+ * opened. It must outlive them.
+ */
+struct ipmi_lan_socket * ipmi_lan_socket_open(void)
+{
+	struct ipmi_lan_socket * sock;
+
+	sock = malloc(sizeof(struct ipmi_lan_socket));
+	if (sock == NULL)
+		return NULL;
+
+	sock->intfs = NULL;
+	sock->rx_dropped = 0;
+	sock->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock->fd < 0) {
+		free(sock);
+		return NULL;
+	}
+
+	return sock;
+}
+
+void ipmi_lan_socket_close(struct ipmi_lan_socket * sock)
+{
+	if (sock == NULL)
+		return;
+
+	close(sock->fd);
+	free(sock);
+}
+
+struct ipmi_lan_caps_cache * ipmi_lan_caps_open(void)
+{
+	struct ipmi_lan_caps_cache * cache;
+
+	cache = malloc(sizeof(struct ipmi_lan_caps_cache));
+	if (cache == NULL)
+		return NULL;
+
+	memset(cache, 0, sizeof(struct ipmi_lan_caps_cache));
+	return cache;
+}
+
+void ipmi_lan_caps_close(struct ipmi_lan_caps_cache * cache)
+{
+	free(cache);
+}
@@ -1,10 +1,10 @@
 #include <ipmi.h>
 #include <ipmi_intf.h>
 #include <mtca.h>
+#include <lan.h>
+#include <stdlib.h>
 #include <string.h>
 
-extern struct ipmi_intf ipmi_lan_intf;
-
 struct ipmi_intf * open_lan_session(unsigned char *hostname, 
 									unsigned char *username, 
 									unsigned char *password, 
@@ -14,10 +14,17 @@ struct ipmi_intf * open_lan_session(unsigned char *hostname,
 									unsigned char transit_ch
 									){
 		
-	struct ipmi_intf *intf = &ipmi_lan_intf;
+	struct ipmi_intf *intf;
+
+	/* Each session gets its own copy of the LAN interface */
+	intf = malloc(sizeof(struct ipmi_intf));
+	if (intf == NULL)
+		return NULL;
+	memcpy(intf, &ipmi_lan_intf, sizeof(struct ipmi_intf));
 	
 	if (intf->setup(intf) < 0){
 		//printf("Error: Unable to setup interface LAN");
+		free(intf);
 		return NULL;
 	}
 	
@@ -42,17 +49,117 @@ struct ipmi_intf * open_lan_session(unsigned char *hostname,
 	return intf;
 }
 
+void close_lan_session(struct ipmi_intf *intf){
+	if(intf == NULL)
+		return;
+
+	intf->close(intf);
+	free(intf);
+}
+
+struct ipmi_lan_socket * open_lan_socket(void){
+	return ipmi_lan_socket_open();
+}
+
+void close_lan_socket(struct ipmi_lan_socket *sock){
+	ipmi_lan_socket_close(sock);
+}
+
+int share_lan_socket(struct ipmi_intf *intf, struct ipmi_lan_socket *sock){
+	if(intf == NULL || intf->opened)
+		return -1;
+
+	intf->sock = sock;
+	return 0;
+}
+
+struct ipmi_lan_caps_cache * open_lan_caps(void){
+	return ipmi_lan_caps_open();
+}
+
+void close_lan_caps(struct ipmi_lan_caps_cache *caps){
+	ipmi_lan_caps_close(caps);
+}
+
+int share_lan_caps(struct ipmi_intf *intf, struct ipmi_lan_caps_cache *caps){
+	if(intf == NULL || intf->opened)
+		return -1;
+
+	intf->caps = caps;
+	return 0;
+}
+
 struct ipmi_rs * send_ipmi_cmd(struct ipmi_intf *intf, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len){
+	return send_ipmi_cmd_to(intf, 0, 0, netfn, cmd, data, data_len);
+}
+
+static void init_req(struct ipmi_intf *intf, struct ipmi_rq *req, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len){
+	memset(req, 0, sizeof(*req));	//Init
+	req->msg.netfn = netfn;
+	req->msg.cmd = cmd;
+	req->msg.data = data;
+	req->msg.data_len = data_len;
+
+	//Bridge through the same transit controller as the session
+	if(target_addr > 0){
+		req->target_addr = target_addr;
+		req->target_channel = target_ch;
+		req->transit_addr = intf->transit_addr;
+		req->transit_channel = intf->transit_channel;
+	}
+}
+
+struct ipmi_rs * send_ipmi_cmd_to(struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len){
 	struct ipmi_rq req;
 
 	if(intf == NULL)
 		return NULL;
 	
-	memset(&req, 0, sizeof(req));	//Init
-	req.msg.netfn = netfn;
-	req.msg.cmd = cmd;
-	req.msg.data = data;
-	req.msg.data_len = data_len;
+	init_req(intf, &req, target_addr, target_ch, netfn, cmd, data, data_len);
 	
 	return intf->sendrecv(intf, &req);
+}
+
+int send_ipmi_cmd_async(struct ipmi_intf *intf, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len){
+	return send_ipmi_cmd_async_to(intf, 0, 0, netfn, cmd, data, data_len);
+}
+
+int send_ipmi_cmd_async_to(struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len){
+	struct ipmi_rq req;
+
+	if(intf == NULL)
+		return -1;
+	
+	init_req(intf, &req, target_addr, target_ch, netfn, cmd, data, data_len);
+	
+	return intf->send(intf, &req);
+}
+
+int queue_ipmi_cmd_payload(struct ipmi_engine *e, struct ipmi_intf *intf, unsigned char target_addr, unsigned char target_ch, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len, unsigned char *payload, unsigned int payload_len, unsigned int flags, ipmi_rsp_handler handler, void *arg){
+	struct ipmi_rq req;
+
+	if(intf == NULL)
+		return -1;
+	
+	init_req(intf, &req, target_addr, target_ch, netfn, cmd, data, data_len);
+	req.payload = payload;
+	req.payload_len = payload_len;
+	req.once = (flags & IPMI_QUEUE_ONCE) != 0;
+	req.no_retry = (flags & IPMI_QUEUE_NO_RETRY) != 0;
+	
+	return ipmi_engine_send(e, intf, &req, handler, arg);
+}
+
+struct ipmi_rs * recv_ipmi_rsp(struct ipmi_intf *intf, unsigned long timeout_us){
+	if(intf == NULL)
+		return NULL;
+
+	return intf->recv(intf, timeout_us);
+}
+
+void cancel_ipmi_cmd(struct ipmi_intf *intf, unsigned char seq){
+	if(intf == NULL)
+		return;
+
+	intf->cancel(intf, seq);
 }
\ No newline at end of file
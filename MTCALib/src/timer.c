@@ -0,0 +1,191 @@
+#include <ipmi_timer.h>
+#include <string.h>
+
+#define IPMI_TIMER_MASK		(IPMI_TIMER_SLOTS - 1)
+
+/* Slot index of a tick at a level */
+#define IPMI_TIMER_INDEX(tick, level)	(((tick) >> (IPMI_TIMER_BITS * (level))) & IPMI_TIMER_MASK)
+
+void ipmi_timer_init(struct ipmi_timer_wheel * w, uint64_t now)
+{
+	memset(w, 0, sizeof(struct ipmi_timer_wheel));
+	w->now = now;
+}
+
+static void ipmi_timer_link(struct ipmi_timer ** head, struct ipmi_timer * t)
+{
+	t->next = *head;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+/*
+ * A timer goes to the lowest level whose current slot holds its tick: the
+ * levels never overlap, every timer of a level expires before those of
+ * the next one.
+ */
+static void ipmi_timer_add(struct ipmi_timer_wheel * w, struct ipmi_timer * t)
+{
+	int level;
+
+	for (level = 0; level < IPMI_TIMER_LEVELS - 1; level++) {
+		if ((t->expires >> (IPMI_TIMER_BITS * (level + 1))) == (w->now >> (IPMI_TIMER_BITS * (level + 1))))
+			break;
+	}
+
+	t->level = level;
+	t->slot = IPMI_TIMER_INDEX(t->expires, level);
+	ipmi_timer_link(&w->slots[level][t->slot], t);
+	w->used[level] |= 1ULL << t->slot;
+}
+
+static void ipmi_timer_unlink(struct ipmi_timer_wheel * w, struct ipmi_timer * t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	if (t->level < IPMI_TIMER_LEVELS && w->slots[t->level][t->slot] == NULL)
+		w->used[t->level] &= ~(1ULL << t->slot);
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void ipmi_timer_arm(struct ipmi_timer_wheel * w, struct ipmi_timer * t, uint64_t expires)
+{
+	if (ipmi_timer_armed(t))
+		ipmi_timer_unlink(w, t);
+	else
+		w->count++;
+
+	t->expires = (expires < w->now) ? w->now : expires;
+	ipmi_timer_add(w, t);
+}
+
+void ipmi_timer_cancel(struct ipmi_timer_wheel * w, struct ipmi_timer * t)
+{
+	if (!ipmi_timer_armed(t))
+		return;
+
+	ipmi_timer_unlink(w, t);
+	w->count--;
+}
+
+/* Take a whole slot out of the wheel: its timers are linked again right away */
+static struct ipmi_timer * ipmi_timer_take(struct ipmi_timer_wheel * w, int level, int slot)
+{
+	struct ipmi_timer * list = w->slots[level][slot];
+
+	w->slots[level][slot] = NULL;
+	w->used[level] &= ~(1ULL << slot);
+	return list;
+}
+
+/*
+ * w->now just entered a new 64 ms block: bring down the timers of the
+ * slots starting at this tick, highest level first.
+ */
+static void ipmi_timer_cascade(struct ipmi_timer_wheel * w)
+{
+	struct ipmi_timer * t, * list;
+	int level, top;
+
+	for (top = 1; top < IPMI_TIMER_LEVELS - 1 && IPMI_TIMER_INDEX(w->now, top) == 0; top++);
+
+	for (level = top; level > 0; level--) {
+		list = ipmi_timer_take(w, level, IPMI_TIMER_INDEX(w->now, level));
+		while ((t = list) != NULL) {
+			list = t->next;
+			ipmi_timer_add(w, t);
+		}
+	}
+}
+
+/* Move the timers of the ticks up to target to the due list */
+static void ipmi_timer_advance(struct ipmi_timer_wheel * w, uint64_t target)
+{
+	struct ipmi_timer * t, * list;
+	uint64_t left;
+	int level, slot;
+
+	while (w->now <= target) {
+		for (level = 0; level < IPMI_TIMER_LEVELS && w->used[level] == 0; level++);
+		if (level == IPMI_TIMER_LEVELS) {
+			/* nothing in the wheel: no slot to visit on the way */
+			w->now = target + 1;
+			return;
+		}
+
+		slot = w->now & IPMI_TIMER_MASK;
+		if (w->used[0] & (1ULL << slot)) {
+			list = ipmi_timer_take(w, 0, slot);
+			while ((t = list) != NULL) {
+				list = t->next;
+				t->level = IPMI_TIMER_LEVELS;
+				ipmi_timer_link(&w->due, t);
+			}
+		}
+
+		/* skip to the next used tick of this block, or to the next block */
+		left = (w->used[0] >> slot) >> 1;
+		if (left != 0)
+			w->now += 1 + __builtin_ctzll(left);
+		else
+			w->now = (w->now | IPMI_TIMER_MASK) + 1;
+		if (w->now > target + 1)
+			w->now = target + 1;
+
+		if ((w->now & IPMI_TIMER_MASK) == 0)
+			ipmi_timer_cascade(w);
+	}
+}
+
+uint64_t ipmi_timer_next(struct ipmi_timer_wheel * w)
+{
+	struct ipmi_timer * t;
+	uint64_t bits, next;
+	int level, slot;
+
+	if (w->due != NULL)
+		return 0;
+
+	/* level 0: one tick per slot */
+	bits = w->used[0] >> (w->now & IPMI_TIMER_MASK);
+	if (bits != 0)
+		return w->now + __builtin_ctzll(bits);
+
+	/* above: the first used slot after the current one holds the first expiry */
+	for (level = 1; level < IPMI_TIMER_LEVELS; level++) {
+		slot = IPMI_TIMER_INDEX(w->now, level);
+		bits = w->used[level] & ~((2ULL << slot) - 1);
+		if (bits == 0 && level == IPMI_TIMER_LEVELS - 1)
+			bits = w->used[level];		/* wrapped around */
+		if (bits == 0)
+			continue;
+
+		next = UINT64_MAX;
+		for (t = w->slots[level][__builtin_ctzll(bits)]; t != NULL; t = t->next) {
+			if (t->expires < next)
+				next = t->expires;
+		}
+		return next;
+	}
+
+	return UINT64_MAX;
+}
+
+struct ipmi_timer * ipmi_timer_pop(struct ipmi_timer_wheel * w, uint64_t now)
+{
+	struct ipmi_timer * t;
+
+	if (w->due == NULL)
+		ipmi_timer_advance(w, now);
+
+	t = w->due;
+	if (t != NULL)
+		ipmi_timer_cancel(w, t);
+
+	return t;
+}
@@ -1,9 +1,41 @@
 #ifndef HEX2BIN_H
 #define HEX2BIN_H
 
-#define MAX_LINE_LEN	128
+#include <stdbool.h>
 
-unsigned int compute_binary_size(FILE *fp, unsigned int *firstAddr, unsigned int *lastAddr);
-unsigned char *get_binary(const char *filename, unsigned int *firstAddr, unsigned int *lastAddr);
+#define HEX_SEGMENT_MIN_ALLOC	4096	//First allocation of a segment, doubled as records are appended
+#define HEX_PARALLEL_CHUNK	(4 << 20)	//Bytes of HEX file per decoding thread, at least
+#define HEX_MAX_THREADS		16
 
-#endif
\ No newline at end of file
+/** Bytes at consecutive addresses */
+typedef struct hex_segment_s{
+	unsigned int addr;
+	unsigned int len;
+	unsigned char *data;
+}hex_segment_t;
+
+/** Firmware image: the data only, gaps between segments are not stored */
+typedef struct hex_image_s{
+	hex_segment_t *segments;	//Sorted by address, neither overlapping nor adjacent
+	unsigned int nb_segments;
+	unsigned int first_addr;
+	unsigned int last_addr;		//Address following the last byte
+	bool has_start;
+	unsigned int start_addr;	//Entry point, from a record 03 (CS:IP) or 05
+}hex_image_t;
+
+/** Decode an Intel HEX file (records 00 to 05), checking the record checksums if verify. Returns 0, or -1 after printing the error */
+int hex_load(const char *filename, hex_image_t *img, bool verify);
+
+/** Same, split over that many threads (0: one per HEX_PARALLEL_CHUNK bytes, up to the number of CPUs) */
+int hex_load_parallel(const char *filename, hex_image_t *img, unsigned int threads, bool verify);
+
+/** Load a raw binary file, as one segment at address 0 */
+int hex_load_bin(const char *filename, hex_image_t *img);
+
+/** Copy len bytes from address addr, 0xFF where no segment holds data */
+void hex_copy(const hex_image_t *img, unsigned int addr, unsigned char *dst, unsigned int len);
+
+void hex_free(hex_image_t *img);
+
+#endif
@@ -3,18 +3,50 @@
 
 #define Version_desc    "CERN MMC"
 
+#include <hex2bin.h>
+
+#define HPM_HEADER_SIZE 35
+#define HPM_ACTION_SIZE 34
+#define HPM_PREFIX_SIZE (HPM_HEADER_SIZE + HPM_ACTION_SIZE)
+
+/** HPM image: header and action record, then the firmware read in place from its segments, then the MD5 */
+typedef struct hpm_image_s{
+    unsigned char prefix[HPM_PREFIX_SIZE];
+    unsigned int prefix_len;
+    const hex_image_t *fw;      //Shall stay loaded while the image is used
+    unsigned int payload_len;
+    unsigned char md5[16];
+    unsigned int size;
+}hpm_image_t;
+
 /** Public function */
-/** HPMPaser: Create the HPM image (returned) - Shall be free before closing the program */
-unsigned char *hpm_parse( unsigned char *binary,
-                          int binsize,
-                          unsigned int *hpmsize,
-                          unsigned char *iana,
-                          unsigned char *prodid,
-                          unsigned char earliest_major,
-                          unsigned char earliest_min,
-                          unsigned char new_maj,
-                          unsigned char new_min,
-			  unsigned int component);
+/** HPMPaser: Build the HPM image view of fw and its checksum - Nothing to free */
+int hpm_build( hpm_image_t *img,
+               const hex_image_t *fw,
+               unsigned char *iana,
+               unsigned char *prodid,
+               unsigned char earliest_major,
+               unsigned char earliest_min,
+               unsigned char new_maj,
+               unsigned char new_min,
+               unsigned int component);
+
+/** Copy len bytes of the image from offset (0xFF in the firmware gaps) */
+void hpm_read( const hpm_image_t *img,
+               unsigned int offset,
+               unsigned char *dst,
+               unsigned int len);
+
+/** Pointer to len bytes of the image from offset, in place when possible, else copied to buf */
+const unsigned char *hpm_data( const hpm_image_t *img,
+                               unsigned int offset,
+                               unsigned int len,
+                               unsigned char *buf);
+
+/** Bytes that can be read in place from offset, up to len */
+unsigned int hpm_contiguous( const hpm_image_t *img,
+                             unsigned int offset,
+                             unsigned int len);
 
 /** Private functions */
 /** Header calculation */
@@ -31,8 +63,7 @@ int header( unsigned char val[],
 /** Upgrade action fields calculation */
 int upgrade_action( unsigned char val[],
                     int offset,
-                    unsigned char *binary,
-                    int binsize,
+                    unsigned int binsize,
 		    unsigned int component);
 
 /** Prepare upgrade fields calculation */
@@ -40,9 +71,4 @@ int prepare_action( unsigned char val[],
                     int offset,
 		    unsigned int component);
 
-/** MD5 hash function */
-void write_md5( char *buf,
-                ssize_t length,
-                unsigned char md5arr[]);
-
 #endif
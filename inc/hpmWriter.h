@@ -3,9 +3,29 @@
 
 #define MAX_ACTION              10
 #define MAX_COMPONENTS  8
-#define DATA_PER_BLOCK  20
+#define MAX_SLOTS       12      //AMC slots behind one MCH
+#define DATA_PER_BLOCK  20      //Smallest firmware block size tried while negotiating
+#define MAX_DATA_PER_BLOCK      64
+#define BLOCK_SIZE_CANDIDATES   { MAX_DATA_PER_BLOCK, 48, 32, 23, DATA_PER_BLOCK }     //23: largest block in a 32 byte IPMB frame
+#define MAX_BLOCK_SIZE_CACHE    64      //Targets (MCH and slot) whose block size is kept
+#define MAX_IP_LEN      64
+#define MAX_WINDOW      32      //Upload blocks in flight (half of the 6-bit rq_seq space)
+#define HPM_CC_BLOCK_SEQUENCE   0x82    //UPLOAD_FIRMWARE_BLOCK refused: block number out of sequence
+#define STATUS_POLL_MIN_MS      2       //GET_UPGRADE_STATUS backoff
+#define STATUS_POLL_MAX_MS      500
+#define VERIFY_MIN_TIMEOUT_MS   30000   //Wait for the MMC after activation, when the image gives no inaccessibility timeout
+#define HPM_COMPONENT_IPMC      1       //The firmware GET_DEVICE_ID reports the revision of
+
+#define AMC_IPMB_ADDR(slot)     (0x70+2*(slot))         //MMC address of an AMC slot
+#define AMC_IPMB_CHANNEL        7                       //IPMB-L, behind the carrier manager
+
+#define RED    "\033[22;31m"
+#define GREEN  "\033[22;32m"
+#define RESET  "\033[0m"
 
 #include <stdbool.h>
+#include <ipmi_timer.h>
+#include <hpmParser.h>
 
 typedef struct action_s{
     unsigned char action;
@@ -13,9 +33,29 @@ typedef struct action_s{
     unsigned char firmware_version[6];
     unsigned char firmware_description[21];
     unsigned int firmware_length;
-    unsigned char data_offset;
+    unsigned int data_offset;
 }action_t;
 
+typedef struct block_s{
+    struct hpm_slot_s *slot;
+    unsigned int index;
+    unsigned int offset;
+    unsigned char len;
+    unsigned char block_nb;
+    int tries;
+    bool acked;
+    bool nak;                   //Rejected, to be sent again
+    unsigned char pad[MAX_DATA_PER_BLOCK];      //Block copy, only when it crosses a firmware gap
+}block_t;
+
+typedef struct block_size_cache_s{
+    unsigned char ip[MAX_IP_LEN];       //MCH
+    unsigned char slot;                 //AMC slot behind it
+    unsigned char manufacturer_id[3];
+    unsigned char product_id[2];
+    unsigned char block_size;
+}block_size_cache_t;
+
 typedef struct img_info_s{
     unsigned char device_id;
     unsigned char manufacturer_id[3];
@@ -31,18 +71,98 @@ typedef struct img_info_s{
 
     unsigned short oem_data_len;
 
-    unsigned char upgrade_timeout;      //5 second per unit
-
     unsigned char nb_actions;
     action_t actions[MAX_ACTION];
 }img_info_t;
 
-unsigned char get_img_information(unsigned char *byte, unsigned int  binsize, bool check_component);
-unsigned char check_hpm_info(unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char amc_slot_number);
-unsigned char hpm_upgrade(unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char amc_slot_number, action_t *action, unsigned char *byte, unsigned int component, bool retries);
-unsigned char get_action(unsigned char *byte, unsigned int binsize);
-int hpmdownload(unsigned char *byte, unsigned int filesize, unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char slot, unsigned int comp, bool retries, bool check_component);
-unsigned char scan_upgrade_status(ipmi_intf * intf, unsigned long max_timeout);
+typedef struct hpm_options_s{
+    bool retries;
+    bool progress;
+    unsigned int window;
+    unsigned char block_size;   //0: negotiated with each target
+    unsigned int max_concurrent;        //Slots programmed at the same time, 0: no limit
+    unsigned int max_per_mch;           //Same, behind one MCH
+    bool shared_socket;                 //One UDP socket for all the MCH sessions
+}hpm_options_t;
+
+//Steps of the upgrade of one AMC, each one waiting for an IPMI response
+typedef enum hpm_state_e{
+    HPM_GET_DEVICE_ID,
+    HPM_GET_CAPABILITIES,
+    HPM_INITIATE,
+    HPM_INITIATE_STATUS,
+    HPM_NEGOTIATE,
+    HPM_UPLOAD,
+    HPM_UPLOAD_STATUS,
+    HPM_FINISH,
+    HPM_FINISH_STATUS,
+    HPM_ACTIVATE,
+    HPM_ACTIVATE_STATUS,
+    HPM_VERIFY,
+    HPM_DONE,
+    HPM_FAILED
+}hpm_state_t;
+
+typedef struct hpm_slot_s{
+    struct hpm_crate_s *crate;
+    struct ipmi_engine *engine;
+    struct ipmi_intf *intf;
+    const hpm_image_t *img;
+    hpm_options_t *opt;
+    unsigned char slot;
+
+    hpm_state_t state;
+    hpm_state_t failed_state;
+    unsigned char error;                //Error code of the failed state
+    bool started;
+    bool reported;
+    bool no_retry;                      //--no-retries, from INITIATE_UPGRADE_ACTION on
+
+    unsigned char action;               //Current index in img_info.actions
+    unsigned char upgrade_timeout;      //5 second per unit
+
+    //UPLOAD_FIRMWARE_BLOCK window
+    unsigned char block_size;
+    unsigned char probe;                //Index in BLOCK_SIZE_CANDIDATES while negotiating
+    unsigned int offset;                //Next byte to send
+    unsigned int acked;                 //Bytes acknowledged
+    unsigned int next;                  //Next block index
+    unsigned int oldest;                //Oldest unacknowledged block index
+    unsigned int inflight;
+    bool busy;
+    unsigned int naks;                  //Rejected blocks to be sent again
+    bool resplit;                       //A block was too long: build the blocks again from resplit_from
+    unsigned int resplit_from;
+    bool restart;                       //The MMC lost the block sequence: initiate the upload action again
+    unsigned int restarts;              //Upload restarts of the current action
+    block_t blocks[MAX_WINDOW];         //Indexed by block index % MAX_WINDOW
+
+    //GET_UPGRADE_STATUS polling
+    void (*status_done)(struct hpm_slot_s *s);  //Next step once the long duration command completed
+    unsigned long status_deadline;      //ms
+    unsigned long status_delay;         //ms
+    struct ipmi_timer status_timer;     //Next poll
+}hpm_slot_t;
+
+//One MCH and the AMC slots to program behind it
+typedef struct hpm_crate_s{
+    unsigned char *ip;
+    unsigned char slots[MAX_SLOTS];     //slots[i] set: program slot i+1
+    unsigned int results[MAX_SLOTS];    //0: success
+
+    struct ipmi_intf *intf;             //Opened when its first slot starts
+    bool unreachable;                   //Its session could not be activated
+    unsigned int waiting;
+    unsigned int running;
+    hpm_slot_t hpm_slots[MAX_SLOTS];
+}hpm_crate_t;
+
+unsigned char get_img_information(const hpm_image_t *img, bool check_component);
+unsigned char get_action(const hpm_image_t *img);
+struct ipmi_intf *hpm_open_session(unsigned char *ip, unsigned char *username, unsigned char *password);
+int hpmdownload(const hpm_image_t *img, hpm_crate_t *crates, unsigned int nb_crates, unsigned char *username, unsigned char *password, bool check_component, hpm_options_t *opt);
+unsigned char lookup_block_size(const unsigned char *ip, unsigned char slot);
+void save_block_size(const unsigned char *ip, unsigned char slot, unsigned char block_size);
 //function in main.c
 void set_percent(float percent);
 
@@ -1,103 +1,766 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <hex2bin.h>
 
 /** Refer to https://fr.wikipedia.org/wiki/HEX_%28Intel%29 */
 
-unsigned int compute_binary_size(FILE *fp, unsigned int *firstAddr, unsigned int *lastAddr){
-	
-	unsigned char line[MAX_LINE_LEN];
-	
-	unsigned int addr = 0x00000000;	
-	unsigned int nbBytes;
-	unsigned int localAddr;
-	unsigned int type;
-	unsigned int byte;
-	
-	unsigned char *data;
-	
-	*firstAddr = (unsigned int)-1;
-	*lastAddr = 0;
-	
-	while ( fgets ( line, MAX_LINE_LEN, fp ) != NULL ){
-        
-		sscanf(line,":%2x%4x%2x",&nbBytes, &localAddr, &type);
-		data = &line[9];
-		
-		switch(type){
-			case 0x00:	addr &= 0xFFFF0000;
-						addr |= (localAddr & 0x0000FFFF);
-						
-						if(addr < *firstAddr)	*firstAddr = addr;
-						if((addr+nbBytes) > *lastAddr)	*lastAddr = (addr+nbBytes);
-						
-						break;
-						
-			case 0x04:	sscanf(data,"%4x",&byte);
-						addr = 0x00000000 | (byte << 16);
-						break;
+#define HEX_NO_MEMORY	((unsigned int)-1)
+
+/** Value of every hex digit, tagged with HEX_DIGIT: any other character maps to 0 */
+#define HEX_DIGIT	0x10
+
+static const unsigned char hex_nibble[256] = {
+	['0'] = HEX_DIGIT | 0x0, ['1'] = HEX_DIGIT | 0x1, ['2'] = HEX_DIGIT | 0x2, ['3'] = HEX_DIGIT | 0x3,
+	['4'] = HEX_DIGIT | 0x4, ['5'] = HEX_DIGIT | 0x5, ['6'] = HEX_DIGIT | 0x6, ['7'] = HEX_DIGIT | 0x7,
+	['8'] = HEX_DIGIT | 0x8, ['9'] = HEX_DIGIT | 0x9,
+	['A'] = HEX_DIGIT | 0xA, ['B'] = HEX_DIGIT | 0xB, ['C'] = HEX_DIGIT | 0xC,
+	['D'] = HEX_DIGIT | 0xD, ['E'] = HEX_DIGIT | 0xE, ['F'] = HEX_DIGIT | 0xF,
+	['a'] = HEX_DIGIT | 0xA, ['b'] = HEX_DIGIT | 0xB, ['c'] = HEX_DIGIT | 0xC,
+	['d'] = HEX_DIGIT | 0xD, ['e'] = HEX_DIGIT | 0xE, ['f'] = HEX_DIGIT | 0xF,
+};
+
+/*
+ * Decode nbBytes bytes written as hex digit pairs, adding them to *sum.
+ * Returns -1 if one of the characters is not a hex digit. The validity and
+ * the sum are plain reductions over the line: no branch in the loop.
+ */
+static int hex_decode(const unsigned char *src, unsigned char *dst, unsigned int nbBytes, unsigned int *sum){
+
+	unsigned char valid = HEX_DIGIT;
+	unsigned char hi, lo;
+	unsigned int acc = 0;
+	unsigned int i;
+
+	for(i=0; i<nbBytes; i++){
+		hi = hex_nibble[src[2*i]];
+		lo = hex_nibble[src[2*i+1]];
+		valid &= hi & lo;
+		dst[i] = (unsigned char)((hi << 4) | (lo & 0x0F));
+		acc += dst[i];
+	}
+
+	*sum += acc;
+	return valid ? 0 : -1;
+}
+
+/** Segments being decoded, in file order: only the last one grows */
+typedef struct hex_builder_s{
+	hex_image_t *img;
+	unsigned int cap_segments;
+	size_t cap;				//Allocated bytes of the last segment
+	unsigned int base;			//From the last record 02 or 04
+	bool eof;				//Record 01 found
+	bool verify;				//Check the record checksums
+	bool bad_checksum;			//The bad record failed its checksum
+	bool fixed;				//The last segment is a preallocated slice: it can neither grow nor be followed
+	bool overflow;				//A record did not fit in the slice
+}hex_builder_t;
+
+static hex_segment_t *new_segment(hex_builder_t *b, unsigned int addr){
+
+	hex_image_t *img = b->img;
+	hex_segment_t *seg;
+
+	if(img->nb_segments == b->cap_segments){
+		b->cap_segments = b->cap_segments ? 2*b->cap_segments : 16;
+		seg = realloc(img->segments, b->cap_segments * sizeof(hex_segment_t));
+		if(seg == NULL)	return NULL;
+		img->segments = seg;
+	}
+
+	//The previous segment is complete
+	if(img->nb_segments > 0){
+		seg = &img->segments[img->nb_segments-1];
+		if(seg->len > 0 && (size_t)seg->len < b->cap){
+			unsigned char *data = realloc(seg->data, seg->len);
+			if(data != NULL)	seg->data = data;
 		}
 	}
-	
-	return (*lastAddr - *firstAddr);
+
+	seg = &img->segments[img->nb_segments++];
+	seg->addr = addr;
+	seg->len = 0;
+	seg->data = NULL;
+	b->cap = 0;
+	return seg;
 }
 
-unsigned char *get_binary(const char *filename, unsigned int *firstAddr, unsigned int *lastAddr){
-	
-	FILE *fp;
-	
-	unsigned char *binary;
+/** Room for nbBytes at addr: after the last segment if they follow it, in a new one otherwise */
+static unsigned char *reserve(hex_builder_t *b, unsigned int addr, unsigned int nbBytes){
+
+	hex_image_t *img = b->img;
+	hex_segment_t *seg = img->nb_segments ? &img->segments[img->nb_segments-1] : NULL;
 	unsigned char *data;
-	unsigned char line[MAX_LINE_LEN];
-	
-    size_t len = 0;
-	
-	unsigned int addr = 0x00000000;	
+	size_t cap;
+
+	if(b->fixed && (seg == NULL || (unsigned long long)seg->addr + seg->len != addr || (size_t)seg->len + nbBytes > b->cap)){
+		b->overflow = true;
+		return NULL;
+	}
+
+	if(seg == NULL || (unsigned long long)seg->addr + seg->len != addr){
+		seg = new_segment(b, addr);
+		if(seg == NULL)	return NULL;
+	}
+
+	if((size_t)seg->len + nbBytes > b->cap){
+		cap = b->cap ? b->cap : HEX_SEGMENT_MIN_ALLOC;
+		while(cap < (size_t)seg->len + nbBytes)	cap *= 2;
+		data = realloc(seg->data, cap);
+		if(data == NULL)	return NULL;
+		seg->data = data;
+		b->cap = cap;
+	}
+
+	seg->len += nbBytes;
+	return seg->data + seg->len - nbBytes;
+}
+
+/*
+ * Decode the records of a mapped file in one pass, straight into the segments,
+ * checking their checksum on the way. Returns 0, the line number of the
+ * first bad record, or HEX_NO_MEMORY.
+ */
+static unsigned int decode_records(const unsigned char *p, const unsigned char *end, hex_builder_t *b){
+
+	unsigned char hdr[4];
+	unsigned char rec[255];			//Data of the records other than 00
+	unsigned char csum;
+	unsigned char *dst;
+	unsigned int line = 1;
 	unsigned int nbBytes;
-	unsigned int localAddr;
 	unsigned int type;
-	unsigned int byte;
-	unsigned int i;
-		
-	fp = fopen(filename, "r");
-
-    if (fp == NULL)
-        return NULL;
-	
-	binary = malloc(compute_binary_size(fp, firstAddr, lastAddr));
-	if(binary == NULL)	return NULL;	
-	rewind(fp);
-	
-	for(i=0; i<(*lastAddr - *firstAddr); i++)	binary[i] = 0xff;
-	
-	while ( fgets ( line, MAX_LINE_LEN, fp ) != NULL ){
-		
-		sscanf(line,":%2x%4x%2x",&nbBytes, &localAddr, &type);
-		data = &line[9];
-		
+	unsigned int sum;
+
+	while(p < end){
+
+		if(*p == '\n'){
+			line++;
+			p++;
+			continue;
+		}
+		if(*p == '\r' || *p == ' ' || *p == '\t'){
+			p++;
+			continue;
+		}
+
+		//:LLAAAATT<data>CC, all the bytes adding up to 0
+		sum = 0;
+		if(*p != ':' || end - p < 11 || hex_decode(p+1, hdr, 4, &sum) < 0)	return line;
+		nbBytes = hdr[0];
+		type = hdr[3];
+		if((size_t)(end - p) < 11 + 2*(size_t)nbBytes)	return line;
+
+		dst = rec;
+		if(type == 0x00 && nbBytes > 0){
+			dst = reserve(b, b->base + ((hdr[1] << 8) | hdr[2]), nbBytes);
+			if(dst == NULL)	return HEX_NO_MEMORY;
+		}
+		if(hex_decode(p+9, dst, nbBytes, &sum) < 0 || hex_decode(p+9+2*nbBytes, &csum, 1, &sum) < 0)	return line;
+		if(b->verify && (sum & 0xFF) != 0){
+			b->bad_checksum = true;
+			return line;
+		}
+
 		switch(type){
-			case 0x00:	addr &= 0xFFFF0000;
-						addr |= (localAddr & 0x0000FFFF);
-						
-						for(i=0; i<nbBytes; i++){
-							sscanf(data,"%2x",&byte);
-							binary[(addr - *firstAddr)+i] = (unsigned char)byte;
-							data += 2;
-						}
+			case 0x00:	break;
+
+			case 0x01:	b->eof = true;	//End of file
+						return 0;
+
+			case 0x02:	if(nbBytes != 2)	return line;
+						b->base = ((rec[0] << 8) | rec[1]) << 4;	//Extended segment address
 						break;
-						
-			case 0x04:	sscanf(data,"%4x",&byte);
-						addr = 0x00000000 | (byte << 16);
+
+			case 0x03:	if(nbBytes != 4)	return line;
+						b->img->start_addr = (((rec[0] << 8) | rec[1]) << 4) + ((rec[2] << 8) | rec[3]);	//CS:IP
+						b->img->has_start = true;
 						break;
-			
+
+			case 0x04:	if(nbBytes != 2)	return line;
+						b->base = 0x00000000 | ((unsigned int)rec[0] << 24) | (rec[1] << 16);	//Extended linear address
+						break;
+
+			case 0x05:	if(nbBytes != 4)	return line;
+						b->img->start_addr = ((unsigned int)rec[0] << 24) | (rec[1] << 16) | (rec[2] << 8) | rec[3];	//EIP
+						b->img->has_start = true;
+						break;
+
 			default:	break;
 		}
-		
+
+		p += 11 + 2*nbBytes;
+	}
+
+	return 0;
+}
+
+static hex_segment_t *sort_base;
+
+/** By address, then in file order */
+static int cmp_segments(const void *a, const void *b){
+
+	const hex_segment_t *sa = &sort_base[*(const unsigned int *)a];
+	const hex_segment_t *sb = &sort_base[*(const unsigned int *)b];
+
+	if(sa->addr != sb->addr)	return (sa->addr < sb->addr) ? -1 : 1;
+	return (*(const unsigned int *)a < *(const unsigned int *)b) ? -1 : 1;
+}
+
+static int cmp_index(const void *a, const void *b){
+
+	unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+/*
+ * Sort the segments and merge the ones that touch or overlap. Records
+ * written over others win, as when they were all written in file order.
+ */
+static int sort_segments(hex_image_t *img){
+
+	hex_segment_t *segs = img->segments, *out, *s;
+	unsigned int *order;
+	unsigned int i, j, k, n = img->nb_segments, nb_out = 0;
+	unsigned long long end;
+
+	for(i=1; i<n && (unsigned long long)segs[i-1].addr + segs[i-1].len < segs[i].addr; i++);
+	if(i >= n)	return 0;	//Usual case: already in order
+
+	order = malloc(n * sizeof(unsigned int));
+	out = malloc(n * sizeof(hex_segment_t));
+	if(order == NULL || out == NULL){
+		free(order);
+		free(out);
+		return -1;
+	}
+	for(i=0; i<n; i++)	order[i] = i;
+	sort_base = segs;
+	qsort(order, n, sizeof(unsigned int), cmp_segments);
+
+	for(i=0; i<n; i=j){
+		//Group of the segments reaching one another
+		end = (unsigned long long)segs[order[i]].addr + segs[order[i]].len;
+		for(j=i+1; j<n && segs[order[j]].addr <= end; j++){
+			if((unsigned long long)segs[order[j]].addr + segs[order[j]].len > end)
+				end = (unsigned long long)segs[order[j]].addr + segs[order[j]].len;
+		}
+
+		s = &out[nb_out++];
+		if(j == i+1){
+			*s = segs[order[i]];
+			continue;
+		}
+
+		s->addr = segs[order[i]].addr;
+		s->len = end - s->addr;
+		s->data = malloc(s->len);
+		if(s->data == NULL){
+			nb_out--;
+			for(k=i; k<n; k++)	out[nb_out++] = segs[order[k]];
+			free(segs);
+			img->segments = out;
+			img->nb_segments = nb_out;
+			free(order);
+			return -1;
+		}
+		qsort(&order[i], j-i, sizeof(unsigned int), cmp_index);
+		for(k=i; k<j; k++){
+			memcpy(s->data + (segs[order[k]].addr - s->addr), segs[order[k]].data, segs[order[k]].len);
+			free(segs[order[k]].data);
+		}
+	}
+
+	free(segs);
+	free(order);
+	img->segments = out;
+	img->nb_segments = nb_out;
+	return 0;
+}
+
+/*
+ * Parallel decoding. The file is cut at line boundaries, one chunk per
+ * thread. Records only depend on the address base set by the last record
+ * 02 or 04 before them: a first pass finds the last one of each chunk,
+ * which gives the base every chunk starts with, then the chunks are
+ * decoded at the same time. Their segments are put back in file order
+ * and merged as those of any file.
+ *
+ * The first pass also gives the addresses the data records of each chunk
+ * cover. When the chunks follow one another without gap nor overlap, as
+ * in most firmware files, they are decoded straight into their slice of
+ * a single buffer: no merge, and no second copy of the image.
+ */
+typedef struct hex_chunk_s{
+	const unsigned char *start;
+	const unsigned char *end;
+	pthread_t thread;
+
+	bool has_base;				//The chunk holds a record 02 or 04
+	unsigned int last_base;			//Base it leaves
+	bool eof;				//The chunk holds the record 01
+	bool contiguous;			//The scan reached the chunk end or the record 01, each data record following the previous one
+
+	//Data records before the first base record of the chunk: offsets from the base the chunk starts with
+	bool has_rel;
+	unsigned int rel_first;
+	unsigned int rel_end;
+
+	//Data records after it: addresses
+	bool has_abs;
+	unsigned long long abs_first;
+	unsigned long long abs_end;
+
+	hex_image_t img;
+	hex_builder_t b;
+	unsigned int line;			//0, or line of the first bad record, from the chunk start
+}hex_chunk_t;
+
+/** First pass: base left by the last record 02 or 04 of the chunk. Bad records are left to the decoding */
+static void *scan_chunk(void *arg){
+
+	hex_chunk_t *c = arg;
+	const unsigned char *p = c->start;
+	unsigned char hdr[4];
+	unsigned char ext[2];
+	unsigned int sum = 0;
+	unsigned int off;
+	unsigned long long addr;
+
+	c->contiguous = true;
+	while(p < c->end){
+		if(*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t'){
+			p++;
+			continue;
+		}
+
+		if(*p != ':' || c->end - p < 11 || hex_decode(p+1, hdr, 4, &sum) < 0)	break;
+		if((size_t)(c->end - p) < 11 + 2*(size_t)hdr[0])	break;
+		if(hdr[3] == 0x01){
+			c->eof = true;
+			return NULL;
+		}
+
+		if(hdr[0] == 2 && (hdr[3] == 0x02 || hdr[3] == 0x04) && hex_decode(p+9, ext, 2, &sum) == 0){
+			c->has_base = true;
+			c->last_base = (hdr[3] == 0x02) ? (unsigned int)(((ext[0] << 8) | ext[1]) << 4) : ((unsigned int)ext[0] << 24) | (ext[1] << 16);
+		}
+
+		off = (hdr[1] << 8) | hdr[2];
+		if(hdr[3] == 0x00 && hdr[0] > 0 && !c->has_base){
+			if(c->has_rel && off != c->rel_end)	c->contiguous = false;
+			if(!c->has_rel)	c->rel_first = off;
+			c->has_rel = true;
+			c->rel_end = off + hdr[0];
+		} else if(hdr[3] == 0x00 && hdr[0] > 0){
+			addr = (unsigned long long)c->last_base + off;
+			if(c->has_abs && addr != c->abs_end)	c->contiguous = false;
+			if(!c->has_abs)	c->abs_first = addr;
+			c->has_abs = true;
+			c->abs_end = addr + hdr[0];
+		}
+
+		p += 11 + 2*hdr[0];
+	}
+
+	//Stopped on a bad record: left to the decoding
+	if(p < c->end)	c->contiguous = false;
+	return NULL;
+}
+
+static void *decode_chunk(void *arg){
+
+	hex_chunk_t *c = arg;
+
+	c->b.img = &c->img;
+	c->line = decode_records(c->start, c->end, &c->b);
+	return NULL;
+}
+
+/** Run fn on every chunk, a thread each; the calling thread takes the first one */
+static void run_chunks(hex_chunk_t *chunks, unsigned int nb_chunks, void *(*fn)(void *)){
+
+	unsigned int i;
+	bool *started = calloc(nb_chunks, sizeof(bool));
+
+	for(i=1; i<nb_chunks; i++){
+		if(started == NULL || pthread_create(&chunks[i].thread, NULL, fn, &chunks[i]) != 0)
+			fn(&chunks[i]);
+		else
+			started[i] = true;
 	}
-	
-    fclose(fp);
-	
-    return binary;
-}
\ No newline at end of file
+	fn(&chunks[0]);
+
+	for(i=1; i<nb_chunks; i++){
+		if(started != NULL && started[i])	pthread_join(chunks[i].thread, NULL);
+	}
+	free(started);
+}
+
+static unsigned int count_lines(const unsigned char *p, const unsigned char *end){
+
+	unsigned int lines = 0;
+
+	while((p = memchr(p, '\n', end - p)) != NULL){
+		lines++;
+		p++;
+	}
+
+	return lines;
+}
+
+/*
+ * When the data records of the chunks up to the record 01 cover one range
+ * in file order, each record following the previous one, give every chunk
+ * its slice of a buffer for that range. Returns the buffer, or NULL to
+ * decode the chunks into their own segments.
+ */
+static unsigned char *preallocate(hex_chunk_t *chunks, unsigned int nb_chunks, const unsigned int *bases, hex_segment_t *range){
+
+	hex_chunk_t *c;
+	unsigned long long first = 0, end = 0, from, to;
+	unsigned char *buf;
+	unsigned int i, n;
+	bool any = false;
+
+	for(n=0; n<nb_chunks; n++){
+		c = &chunks[n];
+		if(!c->contiguous)	return NULL;
+
+		if(c->has_rel || c->has_abs){
+			from = c->has_rel ? (unsigned long long)bases[n] + c->rel_first : c->abs_first;
+			to = c->has_rel ? (unsigned long long)bases[n] + c->rel_end : c->abs_end;
+			if(c->has_rel && c->has_abs){
+				if(c->abs_first != to)	return NULL;
+				to = c->abs_end;
+			}
+			if(any && from != end)	return NULL;
+			if(!any)	first = from;
+			end = to;
+			any = true;
+		}
+
+		if(c->eof)	break;
+	}
+	if(!any || end > 0xFFFFFFFFULL)	return NULL;
+
+	buf = malloc(end - first);
+	if(buf == NULL)	return NULL;
+
+	for(i=0, from=first; i<nb_chunks && i<=n; i++){
+		c = &chunks[i];
+		c->b.fixed = true;
+		if(!c->has_rel && !c->has_abs)	continue;
+
+		to = c->has_abs ? c->abs_end : (unsigned long long)bases[i] + c->rel_end;
+		c->img.segments = malloc(sizeof(hex_segment_t));
+		if(c->img.segments == NULL){
+			for(; i>0; i--)	free(chunks[i-1].img.segments);
+			for(i=0; i<nb_chunks; i++){
+				chunks[i].img.segments = NULL;
+				chunks[i].img.nb_segments = 0;
+				chunks[i].b.fixed = false;
+			}
+			free(buf);
+			return NULL;
+		}
+		c->img.segments[0].addr = from;
+		c->img.segments[0].len = 0;
+		c->img.segments[0].data = buf + (from - first);
+		c->img.nb_segments = 1;
+		c->b.cap_segments = 1;
+		c->b.cap = to - from;
+		from = to;
+	}
+
+	range->addr = first;
+	range->len = end - first;
+	range->data = buf;
+	return buf;
+}
+
+/** Did every chunk up to the record 01, or a bad record, fill its slice exactly? */
+static bool slices_filled(const hex_chunk_t *chunks, unsigned int nb_chunks){
+
+	unsigned int i;
+
+	for(i=0; i<nb_chunks; i++){
+		if(chunks[i].b.overflow)	return false;
+		if(chunks[i].line != 0)	return true;
+		if(chunks[i].img.nb_segments > 0 && chunks[i].img.segments[0].len != chunks[i].b.cap)	return false;
+		if(chunks[i].b.eof)	return true;
+	}
+
+	return true;
+}
+
+static unsigned int decode_parallel(const unsigned char *map, size_t size, hex_image_t *img, unsigned int nb_chunks, bool verify, bool *bad_checksum){
+
+	hex_chunk_t *chunks;
+	hex_segment_t *segs, range;
+	const unsigned char *start, *cut;
+	unsigned char *buf;
+	unsigned int *bases;
+	unsigned int i, n, line = 0, base = 0x00000000, nb_segs = 0;
+
+	chunks = calloc(nb_chunks, sizeof(hex_chunk_t));
+	bases = malloc(nb_chunks * sizeof(unsigned int));
+	if(chunks == NULL || bases == NULL){
+		free(chunks);
+		free(bases);
+		return HEX_NO_MEMORY;
+	}
+
+	//Cut right after a line end
+	for(i=0, n=0, start=map; i<nb_chunks && start < map + size; i++){
+		cut = map + size * (i+1) / nb_chunks;
+		if(cut <= start)	continue;
+		if(i+1 < nb_chunks){
+			cut = memchr(cut - 1, '\n', map + size - (cut - 1));
+			cut = (cut == NULL) ? map + size : cut + 1;
+		}
+		chunks[n].start = start;
+		chunks[n].end = cut;
+		start = cut;
+		n++;
+	}
+	nb_chunks = n;
+
+	run_chunks(chunks, nb_chunks, scan_chunk);
+	for(i=0; i<nb_chunks; i++){
+		chunks[i].b.verify = verify;
+		chunks[i].b.base = base;
+		bases[i] = base;
+		if(chunks[i].has_base)	base = chunks[i].last_base;
+	}
+	buf = preallocate(chunks, nb_chunks, bases, &range);
+
+	run_chunks(chunks, nb_chunks, decode_chunk);
+
+	//The scan guessed the layout wrong: decode again, each chunk into its own segments
+	if(buf != NULL && !slices_filled(chunks, nb_chunks)){
+		free(buf);
+		buf = NULL;
+		for(i=0; i<nb_chunks; i++){
+			if(chunks[i].b.fixed)	free(chunks[i].img.segments);
+			else	hex_free(&chunks[i].img);
+			memset(&chunks[i].img, 0, sizeof(hex_image_t));
+			memset(&chunks[i].b, 0, sizeof(hex_builder_t));
+			chunks[i].b.verify = verify;
+			chunks[i].b.base = bases[i];
+		}
+		run_chunks(chunks, nb_chunks, decode_chunk);
+	}
+	free(bases);
+
+	//Chunks past the end of file record or a bad one do not count
+	for(n=0; n<nb_chunks; n++){
+		nb_segs += chunks[n].img.nb_segments;
+		if(chunks[n].line != 0 || chunks[n].b.eof)	break;
+	}
+	if(n < nb_chunks && chunks[n].line != 0){
+		line = chunks[n].line;
+		*bad_checksum = chunks[n].b.bad_checksum;
+		if(line != HEX_NO_MEMORY)	line += count_lines(map, chunks[n].start);
+	}
+	n = (n < nb_chunks) ? n+1 : nb_chunks;
+
+	//Every slice filled: the buffer is the whole image
+	if(buf != NULL && line == 0)	nb_segs = 1;
+
+	//No data record at all: no segment, hex_load_parallel() reports it
+	segs = NULL;
+	if(line == 0 && nb_segs > 0){
+		segs = malloc(nb_segs * sizeof(hex_segment_t));
+		if(segs == NULL)	line = HEX_NO_MEMORY;
+	}
+	if(line == 0 && buf != NULL)	segs[0] = range;
+
+	for(i=0, nb_segs=0; i<nb_chunks; i++){
+		if(line == 0 && i < n){
+			if(buf == NULL && chunks[i].img.nb_segments > 0){
+				memcpy(segs + nb_segs, chunks[i].img.segments, chunks[i].img.nb_segments * sizeof(hex_segment_t));
+				nb_segs += chunks[i].img.nb_segments;
+			}
+			if(chunks[i].img.has_start){
+				img->has_start = true;
+				img->start_addr = chunks[i].img.start_addr;
+			}
+			free(chunks[i].img.segments);
+		} else if(chunks[i].b.fixed){
+			free(chunks[i].img.segments);	//The slices are freed with the buffer
+		} else {
+			hex_free(&chunks[i].img);
+		}
+	}
+	if(buf != NULL){
+		if(line == 0)	nb_segs = 1;
+		else	free(buf);
+	}
+
+	img->segments = segs;
+	img->nb_segments = nb_segs;
+	free(chunks);
+	return line;
+}
+
+static void set_bounds(hex_image_t *img){
+
+	hex_segment_t *last = &img->segments[img->nb_segments-1];
+
+	img->first_addr = img->segments[0].addr;
+	img->last_addr = last->addr + last->len;
+}
+
+int hex_load(const char *filename, hex_image_t *img, bool verify){
+	return hex_load_parallel(filename, img, 0, verify);
+}
+
+int hex_load_parallel(const char *filename, hex_image_t *img, unsigned int threads, bool verify){
+
+	int fd;
+	struct stat st;
+	unsigned char *map;
+	unsigned int line;
+	bool bad_checksum = false;
+	hex_builder_t b;
+
+	memset(img, 0, sizeof(hex_image_t));
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0){
+		printf("[ERROR]  {hex_load} \t\t Unable to read %s \n", filename);
+		if(fd >= 0)	close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		printf("[ERROR]  {hex_load} \t\t Unable to read %s \n", filename);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if(threads == 0){
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = st.st_size / HEX_PARALLEL_CHUNK;
+		if(cpus > 0 && threads > (unsigned long)cpus)	threads = cpus;
+		if(threads > HEX_MAX_THREADS)	threads = HEX_MAX_THREADS;
+	}
+
+	if(threads > 1){
+		line = decode_parallel(map, st.st_size, img, threads, verify, &bad_checksum);
+	} else {
+		memset(&b, 0, sizeof(b));
+		b.img = img;
+		b.verify = verify;
+		line = decode_records(map, map + st.st_size, &b);
+		bad_checksum = b.bad_checksum;
+	}
+	munmap(map, st.st_size);
+
+	if(line == 0 && img->nb_segments > 0 && sort_segments(img) < 0)	line = HEX_NO_MEMORY;
+
+	if(line == HEX_NO_MEMORY)	printf("[ERROR]  {hex_load} \t\t Out of memory \n");
+	else if(bad_checksum)		printf("[ERROR]  {hex_load} \t\t Checksum error at line %u \n", line);
+	else if(line != 0)			printf("[ERROR]  {hex_load} \t\t Malformed record at line %u \n", line);
+	else if(img->nb_segments == 0)	printf("[ERROR]  {hex_load} \t\t No data record \n");
+
+	if(line != 0 || img->nb_segments == 0){
+		hex_free(img);
+		return -1;
+	}
+
+	set_bounds(img);
+	return 0;
+}
+
+int hex_load_bin(const char *filename, hex_image_t *img){
+
+	FILE *fp;
+	long size;
+
+	memset(img, 0, sizeof(hex_image_t));
+
+	fp = fopen(filename, "rb");
+	if(fp == NULL){
+		printf("[ERROR]  {hex_load_bin} \t\t Unable to read %s \n", filename);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	img->segments = malloc(sizeof(hex_segment_t));
+	if(size <= 0 || img->segments == NULL){
+		printf("[ERROR]  {hex_load_bin} \t\t Unable to read %s \n", filename);
+		fclose(fp);
+		hex_free(img);
+		return -1;
+	}
+	img->nb_segments = 1;
+	img->segments[0].addr = 0;
+	img->segments[0].len = size;
+	img->segments[0].data = malloc(size);
+
+	if(img->segments[0].data == NULL || fread(img->segments[0].data, size, 1, fp) != 1){
+		printf("[ERROR]  {hex_load_bin} \t\t Unable to read %s \n", filename);
+		fclose(fp);
+		hex_free(img);
+		return -1;
+	}
+	fclose(fp);
+
+	set_bounds(img);
+	return 0;
+}
+
+void hex_copy(const hex_image_t *img, unsigned int addr, unsigned char *dst, unsigned int len){
+
+	unsigned long long end = (unsigned long long)addr + len;
+	unsigned long long from, to;
+	unsigned int lo = 0, hi = img->nb_segments, mid;
+	const hex_segment_t *s;
+
+	//First segment ending after addr
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if((unsigned long long)img->segments[mid].addr + img->segments[mid].len <= addr)	lo = mid + 1;
+		else	hi = mid;
+	}
+
+	for(; lo < img->nb_segments && img->segments[lo].addr < end; lo++){
+		s = &img->segments[lo];
+		from = (s->addr > addr) ? s->addr : addr;
+		to = ((unsigned long long)s->addr + s->len < end) ? (unsigned long long)s->addr + s->len : end;
+
+		//Padding is only produced here, in the gaps of the range asked for
+		memset(dst, 0xFF, from - addr);
+		memcpy(dst + (from - addr), s->data + (from - s->addr), to - from);
+		dst += to - addr;
+		len -= to - addr;
+		addr = to;
+	}
+
+	memset(dst, 0xFF, len);
+}
+
+void hex_free(hex_image_t *img){
+
+	unsigned int i;
+
+	for(i=0; i<img->nb_segments; i++)	free(img->segments[i].data);
+	free(img->segments);
+	memset(img, 0, sizeof(hex_image_t));
+}
@@ -16,31 +16,153 @@ Author: Julian Mendez <julian.mendez@cern.ch>
 
 #include <hpmParser.h>
 
-unsigned char *hpm_parse(unsigned char *binary, int binsize, unsigned int *hpmsize, unsigned char *iana, unsigned char *prodid, unsigned char earliest_major, unsigned char earliest_min, unsigned char new_maj, unsigned char new_min, unsigned int component)
+/** Feed MD5 with len bytes of the image from offset, without copying the firmware */
+static void hpm_md5_update(MD5_CTX *c, const hpm_image_t *img, unsigned int offset, unsigned int len)
 {
-    int offset = 0, i, filesize;
-    unsigned char *img;
-    unsigned char md5arr[MD5_DIGEST_LENGTH];
-
-    img = (unsigned char *)malloc(binsize+128);
-    if(img == NULL){
-        printf("ERROR: img is NULL \n");
-        return NULL;
+    unsigned char pad[512];             //Gaps are hashed piece by piece
+    const unsigned char *p;
+    unsigned int n;
+
+    memset(pad, 0xFF, sizeof(pad));
+
+    while (len > 0) {
+        //Largest piece that is contiguous in the image parts
+        n = hpm_contiguous(img, offset, len);
+        p = hpm_data(img, offset, n, NULL);
+        if (p == NULL) {
+            //Gap between two firmware segments
+            n = (n < sizeof(pad)) ? n : sizeof(pad);
+            p = pad;
+        }
+        MD5_Update(c, p, n);
+        offset += n;
+        len -= n;
+    }
+}
+
+int hpm_build(hpm_image_t *img, const hex_image_t *fw, unsigned char *iana, unsigned char *prodid, unsigned char earliest_major, unsigned char earliest_min, unsigned char new_maj, unsigned char new_min, unsigned int component)
+{
+    int offset = 0;
+    MD5_CTX c;
+
+    memset(img, 0, sizeof(hpm_image_t));
+    img->fw = fw;
+    img->payload_len = fw->last_addr - fw->first_addr;
+
+    offset += header(img->prefix, 0, iana, prodid, earliest_major, earliest_min, new_maj, new_min, component);
+    offset += upgrade_action(img->prefix, offset, img->payload_len, component);
+    img->prefix_len = offset;
+    img->size = img->prefix_len + img->payload_len + MD5_DIGEST_LENGTH;
+
+    //One pass over the parts, as the receiver will hash them
+    MD5_Init(&c);
+    hpm_md5_update(&c, img, 0, img->prefix_len + img->payload_len);
+    MD5_Final(img->md5, &c);
+
+    return 0;
+}
+
+/** Index of the first firmware segment ending after addr */
+static unsigned int hpm_segment(const hex_image_t *fw, unsigned int addr)
+{
+    unsigned int lo = 0, hi = fw->nb_segments, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (fw->segments[mid].addr + fw->segments[mid].len <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Bytes of the image that can be read in one piece from offset: up to the
+ * end of the header, of a firmware segment or gap, or of the MD5 trailer.
+ */
+unsigned int hpm_contiguous(const hpm_image_t *img, unsigned int offset, unsigned int len)
+{
+    const hex_image_t *fw = img->fw;
+    unsigned int end, addr, i;
+
+    if (offset < img->prefix_len) {
+        end = img->prefix_len;
+    } else if (offset < img->prefix_len + img->payload_len) {
+        addr = fw->first_addr + (offset - img->prefix_len);
+
+        i = hpm_segment(fw, addr);
+        if (addr >= fw->segments[i].addr) {
+            end = fw->segments[i].addr + fw->segments[i].len;
+        } else {
+            end = fw->segments[i].addr;    //Gap up to the next segment
+        }
+        end = img->prefix_len + (end - fw->first_addr);
+    } else {
+        end = img->size;
     }
 
-    offset += header(img, 0, iana, prodid, earliest_major, earliest_min, new_maj, new_min, component);
+    return (end - offset < len) ? end - offset : len;
+}
 
-    offset += upgrade_action(img, offset, binary, binsize, component);
+/*
+ * len bytes of the image from offset, in place when they are contiguous in
+ * one of its parts. Otherwise they are copied to buf, with the gaps
+ * between firmware segments padded with 0xFF: NULL if buf is NULL then.
+ */
+const unsigned char *hpm_data(const hpm_image_t *img, unsigned int offset, unsigned int len, unsigned char *buf)
+{
+    const hex_image_t *fw = img->fw;
+    const hex_segment_t *seg;
+    unsigned int addr;
+
+    if (hpm_contiguous(img, offset, len) == len) {
+        if (offset + len <= img->prefix_len) {
+            return &img->prefix[offset];
+        }
+        if (offset >= img->prefix_len + img->payload_len) {
+            return &img->md5[offset - img->prefix_len - img->payload_len];
+        }
+
+        addr = fw->first_addr + (offset - img->prefix_len);
+        seg = &fw->segments[hpm_segment(fw, addr)];
+        if (addr >= seg->addr) {
+            return &seg->data[addr - seg->addr];
+        }
+    }
 
-    write_md5(img, offset, md5arr);
+    if (buf != NULL) {
+        hpm_read(img, offset, buf, len);
+    }
+    return buf;
+}
 
-    for(i=0; i<MD5_DIGEST_LENGTH; i++){
-        img[offset++] = md5arr[i];
+void hpm_read(const hpm_image_t *img, unsigned int offset, unsigned char *dst, unsigned int len)
+{
+    unsigned int n, end;
+
+    //Header and action record
+    if (offset < img->prefix_len && len > 0) {
+        n = (img->prefix_len - offset < len) ? img->prefix_len - offset : len;
+        memcpy(dst, &img->prefix[offset], n);
+        dst += n;
+        offset += n;
+        len -= n;
     }
 
-    *hpmsize = offset;
+    //Firmware, padded in the gaps
+    end = img->prefix_len + img->payload_len;
+    if (offset < end && len > 0) {
+        n = (end - offset < len) ? end - offset : len;
+        hex_copy(img->fw, img->fw->first_addr + (offset - img->prefix_len), dst, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
 
-    return img;
+    //MD5 trailer
+    if (offset < img->size && len > 0) {
+        n = (img->size - offset < len) ? img->size - offset : len;
+        memcpy(dst, &img->md5[offset - end], n);
+    }
 }
 
 int header(unsigned char val[], unsigned offset, unsigned char *iana, unsigned char *prodid, unsigned char earliest_major, unsigned char earliest_min, unsigned char new_maj, unsigned char new_min, unsigned int component){
@@ -128,7 +250,7 @@ int prepare_action(unsigned char val[], int offset, unsigned int component){
     return (sizeof(act));
 }
 
-int upgrade_action(unsigned char val[], int offset, unsigned char *binary, int binsize, unsigned int component){
+int upgrade_action(unsigned char val[], int offset, unsigned int binsize, unsigned int component){
     int i;
     int checksum = 0;
     
@@ -175,26 +297,6 @@ int upgrade_action(unsigned char val[], int offset, unsigned char *binary, int b
         val[offset+i] = act[i];
     }
 
-    for(i=0; i<binsize; i++){
-        val[i+sizeof(act)+offset] = binary[i];
-    }
-
-    return (sizeof(act)+binsize);
-}
-
-void write_md5(char *buf, ssize_t length, unsigned char md5arr[]){
-    int n;
-    MD5_CTX c;
-    unsigned char out[MD5_DIGEST_LENGTH];
-
-    MD5_Init(&c);
-    MD5_Update(&c, buf, length);
-    MD5_Final(out, &c);
-
-    for(n=0; n<MD5_DIGEST_LENGTH; n++){
-        //printf("%02x ", out[n]);
-        md5arr[n] = out[n];
-    }
-
-    //printf("\n");
+    //The firmware itself follows, it is not copied here
+    return sizeof(act);
 }
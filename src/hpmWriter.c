@@ -1,59 +1,35 @@
 #include <mtca.h>
 #include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <hpmWriter.h>
 
 img_info_t img_info;
 
-int hpmdownload(unsigned char *byte, unsigned int filesize, unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char slot, unsigned int comp, bool retries, bool check_component)
-{
-    unsigned char i;
-
-    printf("\n[INFO] \t {main} \t\t\t Programming MMC slot %d \n",slot);
-
-    switch(get_img_information(byte, filesize, check_component)){
-    case 0xFF:  printf("[ERROR]  {get_img_information} \t\t HPM image header failed \n");       return -1;
-    case 0xFE:  printf("[ERROR]  {get_img_information} \t\t HPM image format version failed \n");       return -1;
-    case 0xFD:  printf("[ERROR]  {get_img_information} \t\t HPM image checksum error \n");      return -1;
-    case 0xFC:  printf("[ERROR]  {get_img_information} \t\t HPM image action checksum error \n");       return -1;
-    case 0xFB:  printf("[ERROR]  {get_img_information} \t\t Upgrade action should affect only one component \n");       return -1;
-    default: printf("[INFO] \t {get_img_information} \t\t HPM image check successful \n");
-    }
+/** Negotiated block sizes, per target (MCH and AMC slot) and manufacturer / product ID */
+static block_size_cache_t block_size_cache[MAX_BLOCK_SIZE_CACHE];
+static unsigned int block_size_cache_len = 0;
 
-    switch(check_hpm_info(ip, username, password, slot)){
-    case 0xFF:  printf("[ERROR]  {check_hpm_info} \t\t Send GET_DEVICE_ID failed \n");  return -1;
-    case 0xFE:  printf("[ERROR]  {check_hpm_info} \t\t Completion code error (expected 0x00) \n");      return -1;
-    case 0xFD:  printf("[ERROR]  {check_hpm_info} \t\t Read data length error (expected 11 bytes) \n"); return -1;
-    case 0xFC:  printf("[ERROR]  {check_hpm_info} \t\t Product id not compatible with HPM image \n");   return -1;
-    case 0xFB:  printf("[ERROR]  {check_hpm_info} \t\t Manufacturer id not compatible with HPM image \n");      return -1;
-    case 0xFA:  printf("[ERROR]  {check_hpm_info} \t\t Current MMC version < than HPM image's earliest compatible version \n"); return -1;
-    case 0xF9:  printf("[ERROR]  {check_hpm_info} \t\t Send GET_TARGET_UPGRADE_CAPABILITIES failed \n");        return -1;
-    case 0xF8:  printf("[ERROR]  {check_hpm_info} \t\t Read data length error (expected 7 bytes) \n");  return -1;
-    case 0xF7:  printf("[ERROR]  {check_hpm_info} \t\t HPM.1 not supported \n");        return -1;
-    case 0xF6:  printf("[ERROR]  {check_hpm_info} \t\t Firmware upgrade is not desirable at this time \n");     return -1;
-    case 0xF5:  printf("[ERROR]  {check_hpm_info} \t\t MMC's capabilities differ with HPM image \n");   return -1;
-    case 0xF4:  printf("[ERROR]  {check_hpm_info} \t\t Component(s) not present \n");   return -1;
-    default: printf("[INFO] \t {check_hpm_info} \t\t HPM image check successful \n");
-    }
-
-    for(i=0; i < img_info.nb_actions; i++){
-        if(img_info.actions[i].action == 0x02){
-            switch(hpm_upgrade(ip, username, password, slot, &img_info.actions[i], byte, img_info.components, retries)){
-            case 0xFF: printf("[ERROR]  {Upgrade action} \t\t Initiate upgrade action failed \n");      return -1;
-            case 0xFE: printf("[ERROR]  {Upgrade action} \t\t Completion code error \n");       return -1;
-            case 0xFD: printf("[ERROR]  {Upgrade action} \t\t Get upgrade status failed \n");   return -1;
-            case 0xFC: printf("[ERROR]  {Upgrade action} \t\t Timeout \n");     return -1;
-            case 0xFB: printf("[ERROR]  {Upgrade action} \t\t Upload firmware block failed \n");        return -1;
-            case 0xFA: printf("[ERROR]  {Upgrade action} \t\t Upgrade failed \n");      return -1;
-            case 0xF9: printf("[ERROR]  {Upgrade action} \t\t Finish firmware upload failed \n");       return -1;
-            case 0xF8: printf("[ERROR]  {Upgrade action} \t\t Upgrade failed (size error) \n"); return -1;
-            default: printf("[INFO] \t {Upgrade action} \t\t Upgrade success \n");
-            }
-        }
-    }
-    return 0x00;
+/*
+ * Open a session to the MCH itself. The AMCs behind it are addressed per
+ * request (AMC_IPMB_ADDR), so the same session can serve every slot.
+ */
+struct ipmi_intf *hpm_open_session(unsigned char *ip, unsigned char *username, unsigned char *password)
+{
+    return open_lan_session(ip,
+                            username,
+                            password,
+                            0,                  //No target: requests name their AMC
+                            0x82,               //Transit through the carrier manager
+                            0,                  //Target channel given per request
+                            0);
 }
 
-unsigned char get_img_information(unsigned char *byte, unsigned int binsize, bool check_component) {
+unsigned char get_img_information(const hpm_image_t *img, bool check_component) {
+    unsigned char byte[HPM_HEADER_SIZE];
+
+    hpm_read(img, 0, byte, sizeof(byte));
 
     unsigned char i;
     unsigned char crc=0;
@@ -102,140 +78,33 @@ unsigned char get_img_information(unsigned char *byte, unsigned int binsize, boo
     img_info.oem_data_len = (unsigned short)byte[32];
     img_info.oem_data_len += ((unsigned short)byte[33]) * 256;
 
-    return get_action(byte, binsize);
+    return get_action(img);
 }
 
-unsigned char check_hpm_info(unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char amc_slot_number)
+unsigned char get_action(const hpm_image_t *img)
 {
-    unsigned char len, i, offset;
-
-    unsigned char data[25];
-    struct ipmi_rs *rsp;
-
-    struct ipmi_intf *intf = open_lan_session(ip,
-                                              username,
-                                              password,
-                                              (0x70+2*amc_slot_number),                 //No target specified (Default: MCH)
-                                              0x82,                                     //No transit addr specified (Default: 0)
-                                              7,                                        //No target channel specified (Default: 0)
-                                              0);
-
-    rsp = send_ipmi_cmd(intf, 0x06, 0x01, NULL, 0);
-    if(rsp == NULL) {
-        intf->close(intf);
-        return 0xFF;
-    } else {
-        printf("[INFO] \t {GET_DEVICE_ID} \t\t Completion Code : 0x%02x \n", rsp->ccode);
-        if(rsp->ccode) {
-            printf("[INFO] \t {GET_DEVICE_ID} \t\t Completion Code : 0x%02x \n", rsp->ccode);
-            intf->close(intf);
-            return 0xFE;
-        }
-
-        if(rsp->data_len != 11){
-            intf->close(intf);
-            return 0xFD;
-        }
-
-        if(rsp->data[9] != img_info.product_id[0] || rsp->data[10] != img_info.product_id[1]){
-            intf->close(intf);
-            return 0xFC;
-        }  //Check product ID
-
-        if(rsp->data[6] != img_info.manufacturer_id[0] || rsp->data[7] != img_info.manufacturer_id[1] || rsp->data[8] != img_info.manufacturer_id[2]) {
-            intf->close(intf);
-            return 0xFB;
-        }//Check Manufacturer ID
-
-        if(rsp->data[2] < img_info.earliest_compatibility_vers[0] || (rsp->data[2] == img_info.earliest_compatibility_vers[0] && rsp->data[3] < img_info.earliest_compatibility_vers[1])) {
-            intf->close(intf);
-            return 0xFA;
-        }//Check vers.
-    }
-
-    printf("[INFO] \t {check_hpm_info} \t\t version %d.%d will be replace by %d.%d \n", rsp->data[2], rsp->data[3], img_info.firware_rev[0], img_info.firware_rev[1]);
-
-    rsp = send_ipmi_cmd(intf, 0x2c, 0x2E, NULL, 0);
-    if(rsp == NULL){
-        intf->close(intf);
-        return 0xF9;
-    }else{
-        if(rsp->ccode){
-            printf("[INFO] \t {GET_TARGET_UPGRADE_CAPABILITIES} \t Completion Code : 0x%02x \n", rsp->ccode);
-            intf->close(intf);
-            return 0xFE;
-        }
-
-        if(rsp->data_len != 8){
-            intf->close(intf);
-            return 0xF8;
-        }
-
-        if(rsp->data[1] != 0x00){
-            intf->close(intf);
-            return 0xF7;
-        }//HPM.1 not supported
-
-        if(rsp->data[2] & 0x01){
-            intf->close(intf);
-            return 0xF6;
-        }//Firmware upgrade is not desirable at this time
-
-        //img_info.image_capabilities
-        //      Byte [2] : Manual roll-back capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-        //      Byte [1] : Automatic roll-back capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-        //      Byte [2] : Self-test capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-        //
-        //GET_TARGET_UPGRADE_CAPABILITIES - rsp->data[2]
-        //      Byte [2] : Manual roll-back capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-        //      Byte [1] : Automatic roll-back capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-        //      Byte [2] : Self-test capabilities
-        //                                      0b = Not supported
-        //                                      1b = Supported
-
-        if((rsp->data[2] & 0x07) != (img_info.image_capabilities & 0x07)) {
-            intf->close(intf);
-            return 0xF5;
-        }//Capabilities are different between HPM image and MMC's information
-        if((rsp->data[7] & img_info.components) !=  img_info.components) {
-            intf->close(intf);
-            return 0xF4;
-        }//Component(s) not present
-
-        img_info.upgrade_timeout = rsp->data[3]; //5 second per unit
-    }
-
-    intf->close(intf);
-}
-
-unsigned char get_action(unsigned char *byte, unsigned int binsize)
-{
-    unsigned int offset = 35 + img_info.oem_data_len;
+    unsigned int offset = HPM_HEADER_SIZE + img_info.oem_data_len;
+    unsigned char byte[HPM_ACTION_SIZE];
+    unsigned int k;
     unsigned char chksum, i, j;
 
     img_info.nb_actions = 0;
 
-    for(i=0; i < MAX_ACTION && offset < (binsize-16); i++){
-        img_info.actions[i].action = byte[offset++];
-        img_info.actions[i].components = byte[offset++];
+    for(i=0; i < MAX_ACTION && offset < (img->size-16); i++){
+        //Only the action record is read, the firmware stays in the image
+        hpm_read(img, offset, byte, sizeof(byte));
+        k = 0;
+
+        img_info.actions[i].action = byte[k++];
+        img_info.actions[i].components = byte[k++];
 
         chksum = 0 - img_info.actions[i].action - img_info.actions[i].components;
 
-        if(byte[offset] != chksum){
-            printf("[INFO] \t {get_action} \t\t\t checksum 0x%02x (expected 0x%02x) \n",byte[offset], chksum);
+        if(byte[k] != chksum){
+            printf("[INFO] \t {get_action} \t\t\t checksum 0x%02x (expected 0x%02x) \n",byte[k], chksum);
             return 0xFC;
         }
-        offset++;
+        k++;
 
         switch(img_info.actions[i].action){
         case 0x00: printf("[INFO] \t {Action detected} \t\t Backup component (Not implemented yet) \n");        break;
@@ -259,24 +128,26 @@ unsigned char get_action(unsigned char *byte, unsigned int binsize)
                 }
             }
 
-            printf("[INFO] \t {Upgrade action detected} \t Upgrade to version %d.%d \n",byte[offset++], byte[offset++]);
-            offset += 4;
+            printf("[INFO] \t {Upgrade action detected} \t Upgrade to version %d.%d \n", byte[k], byte[k + 1]);
+            k += 6;
 
             printf("[INFO] \t {Upgrade action detected} \t \"");
-            for(j=0; j < 21 && byte[offset+j] != 0; j++)
-                printf("%c",byte[offset+j]);
+            for(j=0; j < 21 && byte[k+j] != 0; j++)
+                printf("%c",byte[k+j]);
             printf("\" firmware \n");
-            offset += 21;
+            k += 21;
 
-            img_info.actions[i].firmware_length = (unsigned int)byte[offset++];
-            img_info.actions[i].firmware_length += ((unsigned int)byte[offset++]) * 256;
-            img_info.actions[i].firmware_length += ((unsigned int)byte[offset++]) * 65536;
-            img_info.actions[i].firmware_length += ((unsigned int)byte[offset++]) * 16777216;
+            img_info.actions[i].firmware_length = (unsigned int)byte[k++];
+            img_info.actions[i].firmware_length += ((unsigned int)byte[k++]) * 256;
+            img_info.actions[i].firmware_length += ((unsigned int)byte[k++]) * 65536;
+            img_info.actions[i].firmware_length += ((unsigned int)byte[k++]) * 16777216;
 
-            img_info.actions[i].data_offset = offset;
-            offset += img_info.actions[i].firmware_length;
+            img_info.actions[i].data_offset = offset + k;
+            k += img_info.actions[i].firmware_length;
         }
 
+        offset += k;
+
         img_info.nb_actions++;
     }
 
@@ -284,146 +155,1094 @@ unsigned char get_action(unsigned char *byte, unsigned int binsize)
 
 }
 
-unsigned char hpm_upgrade(unsigned char *ip, unsigned char *username, unsigned char *password, unsigned char amc_slot_number, action_t *action, unsigned char *byte, unsigned int component, bool retries){
-    unsigned char len, i;
-    unsigned int timeout;
-    unsigned char ccode;
-    unsigned int offset;
-    unsigned char scan_ret;
+static block_size_cache_t *find_block_size(const unsigned char *ip, unsigned char slot)
+{
+    unsigned int i;
+
+    for (i = 0; i < block_size_cache_len; i++) {
+        if (block_size_cache[i].slot == slot &&
+            !strncmp((const char *)block_size_cache[i].ip, (const char *)ip, MAX_IP_LEN) &&
+            !memcmp(block_size_cache[i].manufacturer_id, img_info.manufacturer_id, 3) &&
+            !memcmp(block_size_cache[i].product_id, img_info.product_id, 2))
+            return &block_size_cache[i];
+    }
+
+    return NULL;
+}
+
+unsigned char lookup_block_size(const unsigned char *ip, unsigned char slot)
+{
+    block_size_cache_t *entry = find_block_size(ip, slot);
+
+    return (entry != NULL) ? entry->block_size : 0;
+}
+
+void save_block_size(const unsigned char *ip, unsigned char slot, unsigned char block_size)
+{
+    block_size_cache_t *entry = find_block_size(ip, slot);
+
+    if (entry == NULL) {
+        if (block_size_cache_len == MAX_BLOCK_SIZE_CACHE || strlen((const char *)ip) >= MAX_IP_LEN)
+            return;
+
+        entry = &block_size_cache[block_size_cache_len++];
+        strcpy((char *)entry->ip, (const char *)ip);
+        entry->slot = slot;
+        memcpy(entry->manufacturer_id, img_info.manufacturer_id, 3);
+        memcpy(entry->product_id, img_info.product_id, 2);
+    }
+    entry->block_size = block_size;
+}
 
-    unsigned char data[DATA_PER_BLOCK+2];
-    unsigned char block_nb;
 
-    struct ipmi_rs *rsp;
+static unsigned long get_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Error code reported when a step gets no response at all */
+static unsigned char hpm_no_response(hpm_state_t state)
+{
+    switch(state){
+    case HPM_GET_DEVICE_ID:     return 0xFF;
+    case HPM_GET_CAPABILITIES:  return 0xF9;
+    case HPM_INITIATE:          return 0xFF;
+    case HPM_INITIATE_STATUS:
+    case HPM_UPLOAD_STATUS:
+    case HPM_ACTIVATE_STATUS:   return 0xFD;
+    case HPM_FINISH:            return 0xF9;
+    case HPM_FINISH_STATUS:     return 0xF8;
+    case HPM_ACTIVATE:          return 0xF7;
+    case HPM_VERIFY:            return 0xF5;
+    default:                    return 0xFB;
+    }
+}
+
+static void hpm_fail(hpm_slot_t *s, unsigned char error)
+{
+    s->failed_state = s->state;
+    s->error = error;
+    s->state = HPM_FAILED;
+    ipmi_engine_timer_cancel(s->engine, &s->status_timer);
+}
+
+static void hpm_send(hpm_slot_t *s, unsigned char netfn, unsigned char cmd, unsigned char *data, unsigned char data_len, ipmi_rsp_handler handler, void *arg)
+{
+    unsigned int flags = s->no_retry ? IPMI_QUEUE_NO_RETRY : 0;
+
+    if (queue_ipmi_cmd_payload(s->engine, s->intf, AMC_IPMB_ADDR(s->slot), AMC_IPMB_CHANNEL, netfn, cmd, data, data_len, NULL, 0, flags, handler, arg) < 0)
+        hpm_fail(s, hpm_no_response(s->state));
+}
+
+static void hpm_start_action(hpm_slot_t *s);
+static void hpm_start_upload(hpm_slot_t *s);
+static void hpm_resume_upload(hpm_slot_t *s);
+static void hpm_upload_fill(hpm_slot_t *s);
+static void hpm_activate(hpm_slot_t *s);
+
+/*
+ * GET_UPGRADE_STATUS: poll until the long duration command completes, then
+ * call done. The MMC gets upgrade_timeout (5 second units) to finish it.
+ * The delay between two polls starts at STATUS_POLL_MIN_MS and doubles up
+ * to STATUS_POLL_MAX_MS.
+ */
+static void on_status(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg);
+
+static void hpm_poll_status(void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    hpm_send(s, 0x2c, 0x34, NULL, 0, on_status, s);
+}
+
+static void hpm_wait_status(hpm_slot_t *s, hpm_state_t state, void (*done)(hpm_slot_t *s))
+{
+    s->state = state;
+    s->status_done = done;
+    s->status_deadline = get_time_ms() + s->upgrade_timeout * 5000;
+    s->status_delay = STATUS_POLL_MIN_MS;
+    hpm_poll_status(s);
+}
+
+static void hpm_status_fail(hpm_slot_t *s, unsigned char error)
+{
+    //Image validation failures are reported as such
+    hpm_fail(s, (s->state == HPM_FINISH_STATUS) ? 0xF8 : error);
+}
+
+static void on_status(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+    unsigned long now, delay;
+
+    (void)intf;
+
+    if (s->state == HPM_FAILED) return;
+
+    //A busy MMC may not answer bridged requests: no answer is no news, the deadline bounds the wait
+    if(rsp != NULL && rsp->ccode == 0x00 && rsp->data_len >= 3) {
+        if(rsp->data[2] == 0x00) {
+            s->status_done(s);
+            return;
+        } else if(rsp->data[2] != 0x80) {
+            printf("[INFO] \t {GET_UPGRADE_STATUS} \t\t Command 0x%02x completion Code : 0x%02x \n", rsp->data[1], rsp->data[2]);
+            hpm_status_fail(s, 0xFA);
+            return;
+        }
+    }
+    //0x80, 0xC3 or no answer from the MMC yet: still in progress
+
+    now = get_time_ms();
+    if(now >= s->status_deadline) {
+        hpm_status_fail(s, 0xFC);
+        return;
+    }
+
+    delay = s->status_delay;
+    if(delay > s->status_deadline - now) {
+        delay = s->status_deadline - now;
+    }
+    s->status_delay *= 2;
+    if(s->status_delay > STATUS_POLL_MAX_MS) {
+        s->status_delay = STATUS_POLL_MAX_MS;
+    }
+
+    if (ipmi_engine_timer(s->engine, &s->status_timer, delay * 1000, hpm_poll_status, s) < 0)
+        hpm_status_fail(s, 0xFD);
+}
+
+/* GET_DEVICE_ID: is the image meant for this MMC? */
+static void on_capabilities(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg);
+
+static void on_device_id(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    (void)intf;
+
+    if(rsp == NULL) {
+        hpm_fail(s, 0xFF);
+        return;
+    }
+
+    printf("[INFO] \t {GET_DEVICE_ID} \t\t Completion Code : 0x%02x \n", rsp->ccode);
+    if(rsp->ccode) {
+        hpm_fail(s, 0xFE);
+        return;
+    }
+
+    if(rsp->data_len != 11){
+        hpm_fail(s, 0xFD);
+        return;
+    }
+
+    if(rsp->data[9] != img_info.product_id[0] || rsp->data[10] != img_info.product_id[1]){
+        hpm_fail(s, 0xFC);
+        return;
+    }  //Check product ID
+
+    if(rsp->data[6] != img_info.manufacturer_id[0] || rsp->data[7] != img_info.manufacturer_id[1] || rsp->data[8] != img_info.manufacturer_id[2]) {
+        hpm_fail(s, 0xFB);
+        return;
+    }//Check Manufacturer ID
+
+    if(rsp->data[2] < img_info.earliest_compatibility_vers[0] || (rsp->data[2] == img_info.earliest_compatibility_vers[0] && rsp->data[3] < img_info.earliest_compatibility_vers[1])) {
+        hpm_fail(s, 0xFA);
+        return;
+    }//Check vers.
+
+    printf("[INFO] \t {check_hpm_info} \t\t version %d.%d will be replace by %d.%d \n", rsp->data[2], rsp->data[3], img_info.firware_rev[0], img_info.firware_rev[1]);
+
+    s->state = HPM_GET_CAPABILITIES;
+    hpm_send(s, 0x2c, 0x2E, NULL, 0, on_capabilities, s);
+}
+
+/* GET_TARGET_UPGRADE_CAPABILITIES: can the MMC take this image now? */
+static void on_capabilities(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    (void)intf;
+
+    if(rsp == NULL){
+        hpm_fail(s, 0xF9);
+        return;
+    }
+
+    if(rsp->ccode){
+        printf("[INFO] \t {GET_TARGET_UPGRADE_CAPABILITIES} \t Completion Code : 0x%02x \n", rsp->ccode);
+        hpm_fail(s, 0xFE);
+        return;
+    }
+
+    if(rsp->data_len != 8){
+        hpm_fail(s, 0xF8);
+        return;
+    }
+
+    if(rsp->data[1] != 0x00){
+        hpm_fail(s, 0xF7);
+        return;
+    }//HPM.1 not supported
+
+    if(rsp->data[2] & 0x01){
+        hpm_fail(s, 0xF6);
+        return;
+    }//Firmware upgrade is not desirable at this time
+
+    //img_info.image_capabilities
+    //      Byte [2] : Manual roll-back capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+    //      Byte [1] : Automatic roll-back capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+    //      Byte [2] : Self-test capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+    //
+    //GET_TARGET_UPGRADE_CAPABILITIES - rsp->data[2]
+    //      Byte [2] : Manual roll-back capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+    //      Byte [1] : Automatic roll-back capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+    //      Byte [2] : Self-test capabilities
+    //                                      0b = Not supported
+    //                                      1b = Supported
+
+    if((rsp->data[2] & 0x07) != (img_info.image_capabilities & 0x07)) {
+        hpm_fail(s, 0xF5);
+        return;
+    }//Capabilities are different between HPM image and MMC's information
+    if((rsp->data[7] & img_info.components) !=  img_info.components) {
+        hpm_fail(s, 0xF4);
+        return;
+    }//Component(s) not present
+
+    s->upgrade_timeout = rsp->data[3]; //5 second per unit
+    if (s->upgrade_timeout == 0) {
+        s->upgrade_timeout = img_info.inaccessibility_timeout;
+    }
+
+    printf("[INFO] \t {check_hpm_info} \t\t HPM image check successful \n");
+
+    hpm_start_action(s);
+}
+
+/* INITIATE_UPGRADE_ACTION for the next upload action of the image */
+static void on_initiate(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    (void)intf;
+
+    if(rsp == NULL){
+        hpm_fail(s, 0xFF);
+        return;
+    }
+
+    if(rsp->ccode != 0x00 && rsp->ccode != 0x80){   //Long action is in progress
+        printf("[INFO] \t {INITIATE_UPGRADE_ACTION} \t Completion Code : 0x%02x \n", rsp->ccode);
+        hpm_fail(s, 0xFE);
+        return;
+    }
+
+    // If retries is disabled, don't resend the IPMI messages of this slot on failure (the MCH session is shared)
+    s->no_retry = !s->opt->retries;
+
+    //wait - scan GET UPGRADE STATUS, only if the MMC started a long duration action
+    if (rsp->ccode == 0x80) {
+        hpm_wait_status(s, HPM_INITIATE_STATUS, hpm_start_upload);
+    } else {
+        hpm_start_upload(s);
+    }
+}
+
+static void hpm_initiate(hpm_slot_t *s)
+{
+    unsigned char data[3];
 
-    struct ipmi_intf *intf = open_lan_session(ip,
-                                              username,
-                                              password,
-                                              (0x70+2*amc_slot_number),                 //No target specified (Default: MCH)
-                                              0x82,                                                             //No transit addr specified (Default: 0)
-                                              7,                                                                        //No target channel specified (Default: 0)
-                                              0);
     //Initiate upgrade action
     data[0] = 0x00;                                             //PICMG ID
-    data[1] = component; //action-> components;              //Component (only one for upgrade action)
+    data[1] = img_info.components;                              //Component (only one for upgrade action)
     data[2] = 0x02;                                             //Upload for upgrade action
 
-    rsp = send_ipmi_cmd(intf, 0x2c, 0x31, data, 3);
-    if(rsp == NULL){
-        intf->close(intf);
-        return 0xFF;
-    }else{
-        if(rsp->ccode != 0x00 && rsp->ccode != 0x80){   //Long action is in progress
-            printf("[INFO] \t {INITIATE_UPGRADE_ACTION} \t Completion Code : 0x%02x \n", rsp->ccode);
-            intf->close(intf);
-            return 0xFE;
-        }
+    s->state = HPM_INITIATE;
+    hpm_send(s, 0x2c, 0x31, data, 3, on_initiate, s);
+}
+
+static void hpm_start_action(hpm_slot_t *s)
+{
+    for(; s->action < img_info.nb_actions; s->action++){
+        if(img_info.actions[s->action].action == 0x02)
+            break;
     }
 
-    // If retries is disabled, don't resend IPMI messages on failure
-    if (!retries) {
-        intf->session->retry = -1;
+    if(s->action == img_info.nb_actions){
+        s->state = HPM_DONE;
+        return;
     }
 
-    //wait - scan GET UPGRADE STATUS
-    scan_ret = scan_upgrade_status(intf, img_info.inaccessibility_timeout);
+    s->restarts = 0;
+    hpm_initiate(s);
+}
+
+/*
+ * UPLOAD_FIRMWARE_BLOCK: the firmware bytes are sent straight from the image, blk->pad only holds a block crossing a gap.
+ */
+static void send_block(hpm_slot_t *s, block_t *blk, ipmi_rsp_handler handler)
+{
+    unsigned char data[2];
+    unsigned char *payload;
+    action_t *action = &img_info.actions[s->action];
+    unsigned int flags;
+
+    data[0] = 0x00;
+    data[1] = blk->block_nb;
+
+    blk->tries++;
+    payload = (unsigned char *)hpm_data(s->img, action->data_offset + blk->offset, blk->len, blk->pad);
+    flags = s->no_retry ? IPMI_QUEUE_NO_RETRY : 0;
+    if (queue_ipmi_cmd_payload(s->engine, s->intf, AMC_IPMB_ADDR(s->slot), AMC_IPMB_CHANNEL, 0x2c, 0x32, data, 2, payload, blk->len, flags, handler, blk) < 0)
+        hpm_fail(s, hpm_no_response(s->state));
+}
 
-    if( scan_ret != 0 ) {
-        return scan_ret;
+static void hpm_show_progress(hpm_slot_t *s)
+{
+    if (s->opt->progress) {
+        printf("\r[INFO] \t {Upgrade in progress} \t\t %d / %d ", s->acked, img_info.actions[s->action].firmware_length);
+        fflush(stdout);
     }
+}
+
+static void hpm_upload_fail(hpm_slot_t *s, unsigned char error)
+{
+    if (s->opt->progress) printf("\n");
+    hpm_fail(s, error);
+}
+
+/*
+ * Block size negotiation: send the first block with each candidate size,
+ * largest first. 0xC6/0xC7/0xC8 moves on to the next smaller size, any
+ * other completion code fails, and so does a probe the engine gave up on:
+ * a lost datagram says nothing about the size. The first block is
+ * uploaded by the probe that succeeds.
+ */
+static const unsigned char block_sizes[] = BLOCK_SIZE_CANDIDATES;
+
+/* Refused for its length: out of space, request data length invalid or limit exceeded */
+static bool hpm_too_long(unsigned char ccode)
+{
+    return ccode == 0xC6 || ccode == 0xC7 || ccode == 0xC8;
+}
+
+static void on_probe(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg);
+
+static void hpm_send_probe(hpm_slot_t *s)
+{
+    block_t *blk = &s->blocks[0];
+    unsigned int length = img_info.actions[s->action].firmware_length;
+
+    blk->slot = s;
+    blk->index = 0;
+    blk->offset = 0;
+    blk->block_nb = 0;
+    blk->tries = 0;
+    blk->acked = false;
+    blk->nak = false;
+    blk->len = (length < block_sizes[s->probe]) ? length : block_sizes[s->probe];
+
+    send_block(s, blk, on_probe);
+}
+
+static void on_probe(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    block_t *blk = arg;
+    hpm_slot_t *s = blk->slot;
+
+    (void)intf;
+
+    if (s->state == HPM_FAILED) return;
+
+    if (rsp != NULL && (rsp->ccode == 0x00 || rsp->ccode == 0x80)) {
+        s->block_size = block_sizes[s->probe];
+        printf("[INFO] \t {Upgrade in progress} \t\t Slot %d: using %d bytes per block \n", s->slot, s->block_size);
+        save_block_size(s->crate->ip, s->slot, s->block_size);
+
+        s->offset = s->acked = blk->len;
+        s->next = s->oldest = 1;
+        hpm_show_progress(s);
 
-    //Upload firmware block
-    // NOTE: We're consciously performing block_nb's roll over
-    for(offset=0, block_nb=0; offset < action->firmware_length; block_nb++){
-        data[0] = 0x00;
-        data[1] = block_nb;
-        for(i=0; i < DATA_PER_BLOCK && offset < action->firmware_length; i++, offset++){
-            data[i+2] = byte[action->data_offset + offset];
+        if (rsp->ccode == 0x80) {
+            hpm_wait_status(s, HPM_UPLOAD_STATUS, hpm_resume_upload);
+        } else {
+            hpm_resume_upload(s);
         }
+        return;
+    }
 
-        printf("\r[INFO] \t {Upgrade in progress} \t\t                           ");
-        //set_percent(((float)offset)/((float)action->firmware_length));
-        printf("\r[INFO] \t {Upgrade in progress} \t\t %d / %d ", offset, action->firmware_length);
-        fflush(stdout);
+    if (rsp == NULL) {
+        hpm_fail(s, 0xFB);
+        return;
+    }
+
+    if (!hpm_too_long(rsp->ccode)) {
+        printf("[INFO] \t {UPLOAD_FIRMWARE_BLOCK} \t Completion Code : 0x%02x \n", rsp->ccode);
+        hpm_fail(s, 0xFB);
+        return;
+    }
+
+    if (++s->probe == sizeof(block_sizes)) {
+        hpm_fail(s, 0xFB);
+        return;
+    }
+    hpm_send_probe(s);
+}
+
+/*
+ * A block of the negotiated size rejected as too long (0xC6/0xC7/0xC8): go on
+ * with the next smaller candidate. Blocks sent before an earlier step
+ * down, or the short last one, do not count.
+ */
+static bool hpm_step_down(hpm_slot_t *s, block_t *blk, unsigned char ccode)
+{
+    unsigned int i;
 
-        scan_ret = 0xFF;
+    if (!hpm_too_long(ccode) || s->opt->block_size != 0 || blk->len != s->block_size)
+        return false;
 
-        rsp = send_ipmi_cmd(intf, 0x2c, 0x32, data, i+2);
+    for (i = 0; i < sizeof(block_sizes) && block_sizes[i] >= s->block_size; i++);
+    if (i == sizeof(block_sizes))
+        return false;
 
-        if (rsp->ccode != 0x00) {
-            scan_upgrade_status(intf, img_info.inaccessibility_timeout);
+    s->block_size = block_sizes[i];
+    if (s->opt->progress) printf("\n");
+    printf("[INFO] \t {Upgrade in progress} \t\t Slot %d: block rejected, using %d bytes per block \n", s->slot, s->block_size);
+    save_block_size(s->crate->ip, s->slot, s->block_size);
+    return true;
+}
+
+/*
+ * Windowed upload: keep up to opt->window blocks in flight, never more
+ * than that many ahead of the oldest unacknowledged one, so the 8-bit
+ * block number stays unambiguous. The MMC checks the block numbers: it
+ * refuses a block that is not the next one it expects, and acknowledges
+ * again one it already wrote. So a lost block is retransmitted by the
+ * engine, and a rejected one is marked and sent again once the blocks
+ * before it are acknowledged or sent again too, in order. A block too
+ * long for the target splits the window again from it with the smaller
+ * size. Only an MMC refusing the oldest unacknowledged block as out of
+ * sequence has lost track of the upload: it is initiated again. A 0x80
+ * completion code means the MMC accepted the block but started a long
+ * write, so the window is drained and GET_UPGRADE_STATUS polled before
+ * more blocks are sent.
+ */
+static void on_block(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    block_t *blk = arg;
+    hpm_slot_t *s = blk->slot;
+    int max_tries = (!s->no_retry && intf->session->retry > 0) ? intf->session->retry : 1;
+
+    if (s->state == HPM_FAILED) return;
+
+    s->inflight--;
+
+    //The engine gave up on it
+    if (rsp == NULL) {
+        hpm_upload_fail(s, 0xFB);
+        return;
+    }
+
+    //Sent with the size stepped down from: built again anyway
+    if (s->resplit && blk->index >= s->resplit_from) {
+        hpm_upload_fill(s);
+        return;
+    }
+
+    if (rsp->ccode == 0x00 || rsp->ccode == 0x80) {
+        s->busy |= (rsp->ccode == 0x80);
+        blk->acked = true;
+        s->acked += blk->len;
+        while (s->oldest < s->next && s->blocks[s->oldest % MAX_WINDOW].acked)
+            s->oldest++;
+
+        hpm_show_progress(s);
+        hpm_upload_fill(s);
+        return;
+    }
+
+    if (hpm_step_down(s, blk, rsp->ccode) || (hpm_too_long(rsp->ccode) && blk->len > s->block_size)) {
+        //Too long: split again from it with the smaller size
+        if (!s->resplit || blk->index < s->resplit_from)
+            s->resplit_from = blk->index;
+        s->resplit = true;
+    } else if (rsp->ccode == HPM_CC_BLOCK_SEQUENCE && blk->index == s->oldest) {
+        s->restart = true;
+    } else if (blk->tries >= max_tries) {
+        if (s->opt->progress) printf("\n");
+        printf("[INFO] \t {UPLOAD_FIRMWARE_BLOCK} \t Completion Code : 0x%02x \n", rsp->ccode);
+        hpm_fail(s, 0xFB);
+        return;
+    } else {
+        blk->nak = true;
+        s->naks++;
+    }
+    hpm_upload_fill(s);
+}
+
+/* Once the window is drained, initiate the upload action again */
+static void hpm_upload_restart(hpm_slot_t *s)
+{
+    unsigned int max_tries = (!s->no_retry && s->intf->session->retry > 0) ? (unsigned int)s->intf->session->retry : 1;
+
+    if (++s->restarts >= max_tries) {
+        hpm_upload_fail(s, 0xFB);
+        return;
+    }
+
+    if (s->opt->progress) printf("\n");
+    printf("[INFO] \t {Upgrade in progress} \t\t Slot %d: block sequence lost, upload started again \n", s->slot);
+    s->restart = false;
+    hpm_initiate(s);
+}
+
+/* Once the window is drained, forget the blocks from resplit_from on: they are built again with the new size */
+static void hpm_upload_resplit(hpm_slot_t *s)
+{
+    block_t *blk;
+    unsigned int i;
+
+    for (i = s->resplit_from; i < s->next; i++) {
+        blk = &s->blocks[i % MAX_WINDOW];
+        if (blk->acked) s->acked -= blk->len;
+        if (blk->nak) s->naks--;
+    }
+
+    s->resplit = false;
+    s->next = s->resplit_from;
+    s->offset = s->blocks[s->next % MAX_WINDOW].offset;
+    hpm_show_progress(s);
+}
+
+static void hpm_finish(hpm_slot_t *s);
+
+static void hpm_upload_fill(hpm_slot_t *s)
+{
+    action_t *action = &img_info.actions[s->action];
+    block_t *blk;
+    unsigned int i;
+
+    if (s->state == HPM_UPLOAD && s->inflight == 0 && !s->busy) {
+        if (s->restart) {
+            hpm_upload_restart(s);
+            return;
+        }
+        if (s->resplit)
+            hpm_upload_resplit(s);
+    }
+
+    //Rejected blocks first, in order: none ahead of a block still in flight from its first send
+    for (i = s->oldest; s->state == HPM_UPLOAD && !s->busy && !s->restart && !s->resplit && s->naks > 0 && i < s->next; i++) {
+        blk = &s->blocks[i % MAX_WINDOW];
+        if (blk->nak) {
+            blk->nak = false;
+            s->naks--;
+            s->inflight++;
+            send_block(s, blk, on_block);
+        } else if (!blk->acked && blk->tries < 2) {
+            break;
         }
     }
 
-    printf("\n");
+    while (s->state == HPM_UPLOAD && !s->busy && !s->restart && !s->resplit && s->naks == 0 && s->next - s->oldest < s->opt->window && s->offset < action->firmware_length) {
+        blk = &s->blocks[s->next % MAX_WINDOW];
+        blk->slot = s;
+        blk->index = s->next++;
+        blk->offset = s->offset;
+        blk->len = (action->firmware_length - s->offset < s->block_size) ? (action->firmware_length - s->offset) : s->block_size;
+        blk->block_nb = (unsigned char)blk->index;     // NOTE: block_nb rolls over on purpose
+        blk->tries = 0;
+        blk->acked = false;
+        blk->nak = false;
+
+        s->offset += blk->len;
+        s->inflight++;
+        send_block(s, blk, on_block);
+    }
+
+    if (s->state != HPM_UPLOAD || s->inflight > 0)
+        return;
+
+    if (s->busy) {
+        hpm_wait_status(s, HPM_UPLOAD_STATUS, hpm_resume_upload);
+    } else if (s->oldest == s->next && s->offset >= action->firmware_length) {
+        hpm_finish(s);
+    }
+}
+
+static void hpm_resume_upload(hpm_slot_t *s)
+{
+    s->state = HPM_UPLOAD;
+    s->busy = false;
+    hpm_upload_fill(s);
+}
+
+static void hpm_start_upload(hpm_slot_t *s)
+{
+    s->offset = s->acked = 0;
+    s->next = s->oldest = 0;
+    s->inflight = 0;
+    s->busy = false;
+    s->naks = 0;
+    s->resplit = false;
+    s->restart = false;
+
+    s->block_size = s->opt->block_size;
+    if (s->block_size == 0) {
+        s->block_size = lookup_block_size(s->crate->ip, s->slot);
+    }
+
+    if (s->block_size == 0) {
+        s->state = HPM_NEGOTIATE;
+        s->probe = 0;
+        hpm_send_probe(s);
+    } else {
+        hpm_resume_upload(s);
+    }
+}
+
+/* FINISH_FIRMWARE_UPLOAD */
+static void on_finish(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    (void)intf;
+
+    if(rsp == NULL){
+        hpm_fail(s, 0xF9);
+        return;
+    }
+
+    if(rsp->ccode == 0x80){ //Image validation in progress
+        hpm_wait_status(s, HPM_FINISH_STATUS, hpm_activate);
+    } else if(rsp->ccode != 0x00){ //Ignore size error for now
+        printf("[INFO] \t {FINISH_FIRMWARE_UPLOAD} \t Completion Code : 0x%02x \n", rsp->ccode);
+        hpm_fail(s, 0xF8);
+    } else {
+        hpm_activate(s);
+    }
+}
+
+static void hpm_finish(hpm_slot_t *s)
+{
+    unsigned char data[6];
+    action_t *action = &img_info.actions[s->action];
+
+    if (s->opt->progress) {
+        printf("\n");
+    } else {
+        printf("[INFO] \t {Upgrade in progress} \t\t Slot %d: %d bytes uploaded \n", s->slot, action->firmware_length);
+    }
 
-    //FINISH_FIRMWARE_UPLOAD
     data[0] = 0x00;                                             //PICMG ID
-    data[1] = component; //action-> components;              //Component (only one for upgrade action)
+    data[1] = img_info.components;                              //Component (only one for upgrade action)
     data[2] = (unsigned char)(action->firmware_length & 0x000000FF);
     data[3] = (unsigned char)((action->firmware_length >> 8) & 0x000000FF);
     data[4] = (unsigned char)((action->firmware_length >> 16) & 0x000000FF);
     data[5] = (unsigned char)((action->firmware_length >> 24) & 0x000000FF);
 
-    rsp = send_ipmi_cmd(intf, 0x2c, 0x33, data, 6);
-    if(rsp == NULL){
-        intf->close(intf);
-        return 0xF9;
+    s->state = HPM_FINISH;
+    hpm_send(s, 0x2c, 0x33, data, 6, on_finish, s);
+}
+
+/*
+ * GET_DEVICE_ID once activated, on the same session: the MMC may reboot
+ * into the new firmware, so no answer or an MMC still initializing is
+ * polled again until the inaccessibility timeout of the image. Only the
+ * IPMC firmware revision is reported, so it is compared with the one of
+ * the image, laid out as hpm_build() writes it (minor, then major): the
+ * minor one is BCD encoded. Other components only have to answer.
+ */
+static void on_verify(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg);
+
+static void hpm_poll_verify(void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    hpm_send(s, 0x06, 0x01, NULL, 0, on_verify, s);
+}
+
+static void on_verify(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+    unsigned long now, delay;
+
+    (void)intf;
+
+    if (s->state == HPM_FAILED) return;
+
+    if(rsp != NULL && rsp->ccode == 0x00 && rsp->data_len >= 4 && !(rsp->data[2] & 0x80)) {
+        if(img_info.components == HPM_COMPONENT_IPMC &&
+           ((rsp->data[2] & 0x7F) != img_info.firware_rev[1] ||
+            (img_info.firware_rev[0] < 100 && rsp->data[3] != (((img_info.firware_rev[0] / 10) << 4) | (img_info.firware_rev[0] % 10))))) {
+            printf("[INFO] \t {GET_DEVICE_ID} \t\t Running version %d.%02x, expected %d.%02d \n", rsp->data[2] & 0x7F, rsp->data[3], img_info.firware_rev[1], img_info.firware_rev[0]);
+            hpm_fail(s, 0xF6);
+            return;
+        }
+
+        printf("[INFO] \t {Upgrade action} \t\t Upgrade success \n");
+        s->action++;
+        hpm_start_action(s);
+        return;
     }
+    //No answer, or the MMC is still starting (device available bit set)
 
-    if(rsp->ccode != 0x00){ //Ignore size error for now
-        printf("[INFO] \t {FINISH_FIRMWARE_UPLOAD} \t Completion Code : 0x%02x \n", rsp->ccode);
-        intf->close(intf);
-        return 0xF8;
+    now = get_time_ms();
+    if(now >= s->status_deadline) {
+        hpm_fail(s, 0xF5);
+        return;
     }
 
-    /* Activate Firmware */
-    printf("[INFO] \t {ACTIVATE_FIRMWARE_UPLOAD} \t Sending activation command \n");
+    delay = s->status_delay;
+    if(delay > s->status_deadline - now) {
+        delay = s->status_deadline - now;
+    }
+    s->status_delay *= 2;
+    if(s->status_delay > STATUS_POLL_MAX_MS) {
+        s->status_delay = STATUS_POLL_MAX_MS;
+    }
 
-    data[0] = 0x00;          //PICMG ID
-    rsp = send_ipmi_cmd(intf, 0x2c, 0x35, data, 1);
+    if (ipmi_engine_timer(s->engine, &s->status_timer, delay * 1000, hpm_poll_verify, s) < 0)
+        hpm_fail(s, 0xF5);
+}
+
+static void hpm_verify(hpm_slot_t *s)
+{
+    s->state = HPM_VERIFY;
+    s->status_deadline = get_time_ms() + ((img_info.inaccessibility_timeout * 5000 > VERIFY_MIN_TIMEOUT_MS) ? img_info.inaccessibility_timeout * 5000 : VERIFY_MIN_TIMEOUT_MS);
+    s->status_delay = STATUS_POLL_MIN_MS;
+    hpm_poll_verify(s);
+}
+
+/* ACTIVATE_FIRMWARE, then the check of the running version and the next upload action if any */
+static void on_activate(struct ipmi_intf *intf, struct ipmi_rs *rsp, void *arg)
+{
+    hpm_slot_t *s = arg;
+
+    (void)intf;
 
     if(rsp == NULL){
-        intf->close(intf);
-        return 0xF7;
+        hpm_fail(s, 0xF7);
+        return;
     }
 
     if(rsp->ccode == 0x00) {
-        intf->close(intf);
-        return 0x00;
+        hpm_verify(s);
+        return;
+    } else if(rsp->ccode == 0x80) {     //Activation in progress
+        hpm_wait_status(s, HPM_ACTIVATE_STATUS, hpm_verify);
+        return;
     } else if (rsp->ccode == 0xD5) {
         printf("[INFO] \t {ACTIVATE_FIRMWARE_UPLOAD} \t The most recent firmware is already active \n");
     }
 
-    intf->close(intf);
-    return 0xF7;
+    hpm_fail(s, 0xF7);
 }
 
-unsigned char scan_upgrade_status(ipmi_intf * intf, unsigned long max_timeout)
+static void hpm_activate(hpm_slot_t *s)
 {
-    struct ipmi_rs *rsp;
-    unsigned char ccode;
-    unsigned long timeout;
+    unsigned char data[1];
 
-    do{
-        ccode = 0xFF;
+    printf("[INFO] \t {ACTIVATE_FIRMWARE_UPLOAD} \t Sending activation command \n");
 
-        rsp = send_ipmi_cmd(intf, 0x2c, 0x34, NULL, 0);
-        if(rsp == NULL) {
-            intf->close(intf);
-            return 0xFD;
-        } else {
-            if(rsp->ccode == 0x80 || rsp->ccode == 0xc3){
-                usleep(10000);
-            } else if(rsp->ccode == 0x00) {
-                ccode = rsp->data[2];
-                usleep(10000);
-            } else {
-                usleep(10000);
+    data[0] = 0x00;          //PICMG ID
+    s->state = HPM_ACTIVATE;
+    hpm_send(s, 0x2c, 0x35, data, 1, on_activate, s);
+}
+
+static void hpm_start(hpm_slot_t *s)
+{
+    printf("\n[INFO] \t {main} \t\t\t Programming MMC slot %d (MCH %s) \n", s->slot, s->crate->ip);
+
+    s->started = true;
+    s->state = HPM_GET_DEVICE_ID;
+    hpm_send(s, 0x06, 0x01, NULL, 0, on_device_id, s);
+}
+
+static void hpm_report_error(hpm_slot_t *s)
+{
+    if (s->failed_state == HPM_GET_DEVICE_ID || s->failed_state == HPM_GET_CAPABILITIES) {
+        switch(s->error){
+        case 0xFF:  printf("[ERROR]  {check_hpm_info} \t\t Send GET_DEVICE_ID failed \n");  break;
+        case 0xFE:  printf("[ERROR]  {check_hpm_info} \t\t Completion code error (expected 0x00) \n");      break;
+        case 0xFD:  printf("[ERROR]  {check_hpm_info} \t\t Read data length error (expected 11 bytes) \n"); break;
+        case 0xFC:  printf("[ERROR]  {check_hpm_info} \t\t Product id not compatible with HPM image \n");   break;
+        case 0xFB:  printf("[ERROR]  {check_hpm_info} \t\t Manufacturer id not compatible with HPM image \n");      break;
+        case 0xFA:  printf("[ERROR]  {check_hpm_info} \t\t Current MMC version < than HPM image's earliest compatible version \n"); break;
+        case 0xF9:  printf("[ERROR]  {check_hpm_info} \t\t Send GET_TARGET_UPGRADE_CAPABILITIES failed \n");        break;
+        case 0xF8:  printf("[ERROR]  {check_hpm_info} \t\t Read data length error (expected 7 bytes) \n");  break;
+        case 0xF7:  printf("[ERROR]  {check_hpm_info} \t\t HPM.1 not supported \n");        break;
+        case 0xF6:  printf("[ERROR]  {check_hpm_info} \t\t Firmware upgrade is not desirable at this time \n");     break;
+        case 0xF5:  printf("[ERROR]  {check_hpm_info} \t\t MMC's capabilities differ with HPM image \n");   break;
+        case 0xF4:  printf("[ERROR]  {check_hpm_info} \t\t Component(s) not present \n");   break;
+        }
+    } else {
+        switch(s->error){
+        case 0xFF: printf("[ERROR]  {Upgrade action} \t\t Initiate upgrade action failed \n");      break;
+        case 0xFE: printf("[ERROR]  {Upgrade action} \t\t Completion code error \n");       break;
+        case 0xFD: printf("[ERROR]  {Upgrade action} \t\t Get upgrade status failed \n");   break;
+        case 0xFC: printf("[ERROR]  {Upgrade action} \t\t Timeout \n");     break;
+        case 0xFB: printf("[ERROR]  {Upgrade action} \t\t Upload firmware block failed \n");        break;
+        case 0xFA: printf("[ERROR]  {Upgrade action} \t\t Upgrade failed \n");      break;
+        case 0xF9: printf("[ERROR]  {Upgrade action} \t\t Finish firmware upload failed \n");       break;
+        case 0xF8: printf("[ERROR]  {Upgrade action} \t\t Upgrade failed (size error) \n"); break;
+        case 0xF7: printf("[ERROR]  {Upgrade action} \t\t Activate firmware failed \n");    break;
+        case 0xF6: printf("[ERROR]  {Upgrade action} \t\t Running firmware version differs from the HPM image \n");       break;
+        case 0xF5: printf("[ERROR]  {Upgrade action} \t\t No answer from the MMC after activation \n");  break;
+        }
+    }
+}
+
+//End of the handshake: on failure, the requests of the slots already started fail without response
+static void on_open(struct ipmi_intf *intf, int rc, void *arg)
+{
+    hpm_crate_t *crate = arg;
+
+    (void)intf;
+
+    if (rc < 0) {
+        printf(RED "[ERROR]  {hpmdownload} \t\t Unable to open the IPMI session to %s \n" RESET, crate->ip);
+        crate->unreachable = true;
+    }
+}
+
+/*
+ * Open the session to the MCH of a crate and hand it to the engine. The
+ * handshake goes on in the engine, along with those of the other crates:
+ * the first requests of the slots wait for it.
+ */
+static int hpm_open_crate(struct ipmi_engine *engine, struct ipmi_lan_socket *sock, struct ipmi_lan_caps_cache *caps, hpm_crate_t *crate, unsigned char *username, unsigned char *password)
+{
+    unsigned int i;
+
+    crate->intf = hpm_open_session(crate->ip, username, password);
+    if (crate->intf != NULL && sock != NULL) {
+        share_lan_socket(crate->intf, sock);
+    }
+    if (crate->intf != NULL) {
+        share_lan_caps(crate->intf, caps);
+    }
+    if (crate->intf != NULL && ipmi_engine_attach_async(engine, crate->intf, on_open, crate) == 0) {
+        for(i=0; i < MAX_SLOTS; i++){
+            crate->hpm_slots[i].intf = crate->intf;
+        }
+        return 0;
+    }
+
+    printf(RED "[ERROR]  {hpmdownload} \t\t Unable to open the IPMI session to %s \n" RESET, crate->ip);
+    close_lan_session(crate->intf);
+    crate->intf = NULL;
+    return -1;
+}
+
+static void on_closed(struct ipmi_intf *intf, void *arg)
+{
+    (void)arg;
+    close_lan_session(intf);
+}
+
+//Close Session goes through the engine: a silent MCH does not hold up the other crates
+static void hpm_close_crate(struct ipmi_engine *engine, hpm_crate_t *crate)
+{
+    if (ipmi_engine_close(engine, crate->intf, on_closed, NULL) < 0) {
+        ipmi_engine_detach(engine, crate->intf);
+        crate->intf->abort = 1;     //No Close Session from inside the loop
+        close_lan_session(crate->intf);
+    }
+    crate->intf = NULL;
+}
+
+/* Start the next waiting slot of a crate, opening its session first if needed */
+static void hpm_start_next(struct ipmi_engine *engine, struct ipmi_lan_socket *sock, struct ipmi_lan_caps_cache *caps, hpm_crate_t *crate, unsigned char *username, unsigned char *password)
+{
+    unsigned int i;
+
+    if (crate->intf == NULL && hpm_open_crate(engine, sock, caps, crate, username, password) < 0) {
+        //None of its slots can be reached
+        crate->waiting = 0;
+        return;
+    }
+
+    if (crate->unreachable) {
+        crate->waiting = 0;
+        if (crate->running == 0) {
+            hpm_close_crate(engine, crate);
+        }
+        return;
+    }
+
+    for(i=0; i < MAX_SLOTS; i++){
+        if(crate->slots[i] && !crate->hpm_slots[i].started) break;
+    }
+
+    hpm_start(&crate->hpm_slots[i]);
+    crate->waiting--;
+    crate->running++;
+}
+
+/*
+ * Program the selected AMC slots of every crate. Every slot runs its own
+ * state machine on the session of its MCH, all of them driven by one
+ * engine. opt->max_concurrent bounds the slots in progress over the whole
+ * run and opt->max_per_mch those behind one MCH (0: no limit, so
+ * max_per_mch 1 programs the slots of a crate one after the other). A
+ * session is only open while slots behind its MCH are in progress. With
+ * opt->shared_socket all the sessions use a single UDP socket.
+ * crates[].results[i] is set to 0 on success.
+ */
+int hpmdownload(const hpm_image_t *img, hpm_crate_t *crates, unsigned int nb_crates, unsigned char *username, unsigned char *password, bool check_component, hpm_options_t *opt)
+{
+    hpm_crate_t *crate;
+    hpm_slot_t *s;
+    struct ipmi_engine *engine;
+    struct ipmi_lan_socket *sock = NULL;
+    struct ipmi_lan_caps_cache *caps;
+    unsigned int c, i, running = 0, waiting = 0;
+    bool started;
+    int ret = 0;
+
+    for(c=0; c < nb_crates; c++){
+        crate = &crates[c];
+        memset(crate->hpm_slots, 0, sizeof(crate->hpm_slots));
+        crate->intf = NULL;
+        crate->unreachable = false;
+        crate->waiting = crate->running = 0;
+        for(i=0; i < MAX_SLOTS; i++){
+            crate->results[i] = crate->slots[i] ? 1 : 0;
+            crate->waiting += crate->slots[i] ? 1 : 0;
+        }
+    }
+
+    switch(get_img_information(img, check_component)){
+    case 0xFF:  printf("[ERROR]  {get_img_information} \t\t HPM image header failed \n");       return -1;
+    case 0xFE:  printf("[ERROR]  {get_img_information} \t\t HPM image format version failed \n");       return -1;
+    case 0xFD:  printf("[ERROR]  {get_img_information} \t\t HPM image checksum error \n");      return -1;
+    case 0xFC:  printf("[ERROR]  {get_img_information} \t\t HPM image action checksum error \n");       return -1;
+    case 0xFB:  printf("[ERROR]  {get_img_information} \t\t Upgrade action should affect only one component \n");       return -1;
+    default: printf("[INFO] \t {get_img_information} \t\t HPM image check successful \n");
+    }
+
+    engine = ipmi_engine_create();
+    if (engine == NULL) {
+        printf("[ERROR]  {hpmdownload} \t\t Unable to create the IPMI engine \n");
+        return -1;
+    }
+
+    //Capabilities of the MCHs already reached, for the sessions opened next
+    caps = open_lan_caps();
+    if (caps == NULL) {
+        printf("[ERROR]  {hpmdownload} \t\t Unable to create the capabilities cache \n");
+        ipmi_engine_free(engine);
+        return -1;
+    }
+
+    if (opt->shared_socket) {
+        sock = open_lan_socket();
+        if (sock == NULL) {
+            printf("[ERROR]  {hpmdownload} \t\t Unable to open the shared socket \n");
+            ipmi_engine_free(engine);
+            close_lan_caps(caps);
+            return -1;
+        }
+    }
+
+    for(c=0; c < nb_crates; c++){
+        crate = &crates[c];
+        waiting += crate->waiting;
+        for(i=0; i < MAX_SLOTS; i++){
+            crate->hpm_slots[i].crate = crate;
+            crate->hpm_slots[i].engine = engine;
+            crate->hpm_slots[i].img = img;
+            crate->hpm_slots[i].opt = opt;
+            crate->hpm_slots[i].slot = i+1;
+        }
+    }
+
+    while (waiting > 0 || running > 0) {
+        //One slot per crate and per pass, so the global limit is shared fairly
+        do {
+            started = false;
+            for(c=0; c < nb_crates && (opt->max_concurrent == 0 || running < opt->max_concurrent); c++){
+                crate = &crates[c];
+                if(crate->waiting == 0 || (opt->max_per_mch != 0 && crate->running >= opt->max_per_mch)) continue;
+
+                waiting -= crate->waiting;
+                running -= crate->running;
+                hpm_start_next(engine, sock, caps, crate, username, password);
+                waiting += crate->waiting;
+                running += crate->running;
+                started = true;
+            }
+        } while (started);
+
+        if (running == 0) continue;
+
+        if (ipmi_engine_run(engine, ULONG_MAX) <= 0) {
+            //Nothing left to wait for: any slot still running is stuck
+            for(c=0; c < nb_crates; c++){
+                for(i=0; i < MAX_SLOTS; i++){
+                    s = &crates[c].hpm_slots[i];
+                    if(s->started && s->state != HPM_DONE && s->state != HPM_FAILED)
+                        hpm_fail(s, hpm_no_response(s->state));
+                }
             }
         }
-        timeout++;
-    }while((ccode != 0x00));
 
-    return 0x00;
+        //Report each slot as soon as it finishes
+        for(c=0; c < nb_crates; c++){
+            crate = &crates[c];
+            for(i=0; i < MAX_SLOTS; i++){
+                s = &crate->hpm_slots[i];
+                if(!s->started || s->reported || (s->state != HPM_DONE && s->state != HPM_FAILED)) continue;
+
+                s->reported = true;
+                crate->running--;
+                running--;
+                crate->results[i] = (s->state == HPM_DONE) ? 0 : 1;
+                if (crate->results[i]) {
+                    hpm_report_error(s);
+                }
+
+                if (nb_crates > 1) {
+                    printf("%s[INFO] \t {main} \t\t\t MCH %s: AMC slot %d finished: %s \n" RESET, crate->results[i] ? RED : GREEN, crate->ip, s->slot, crate->results[i] ? "failed" : "success");
+                } else if (opt->max_per_mch != 1) {
+                    printf("%s[INFO] \t {main} \t\t\t AMC slot %d finished: %s \n" RESET, crate->results[i] ? RED : GREEN, s->slot, crate->results[i] ? "failed" : "success");
+                }
+            }
+
+            //Free the MCH session as soon as its crate is done
+            if (crate->intf != NULL && crate->waiting == 0 && crate->running == 0) {
+                hpm_close_crate(engine, crate);
+            }
+        }
+    }
+
+    //Wait for the Close Session still in flight
+    while (ipmi_engine_run(engine, ULONG_MAX) > 0);
+
+    ipmi_engine_free(engine);
+    close_lan_socket(sock);
+    close_lan_caps(caps);
+
+    for(c=0; c < nb_crates; c++){
+        for(i=0; i < MAX_SLOTS; i++){
+            if(crates[c].results[i]) ret = -1;
+        }
+    }
+    return ret;
 }
@@ -3,14 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 #include <mtca.h>
 
 #include <hpmParser.h>
 #include <hpmWriter.h>
 #include <hex2bin.h>
 
-#define RED    "\033[22;31m"
-#define RESET  "\033[0m"
 
 #define UC32BIT_BOOTLOADER_OFFSET               0x20000 //Bootloader offset for the AT32UC3A uC type
 #define UC32BIT_HEADER_TO_REPLACE_CNT   8
@@ -22,6 +21,71 @@ static char *getExt (const char *fspec) {
     return e;
 }
 
+/* Set slots[i] for each slot i+1 of a comma separated list, or "all" */
+static int parse_slots(char *list, unsigned char *slots) {
+    char *token, *saveptr;
+    int slot;
+
+    if(!strcmp(list, "all")){
+        memset(slots, 1, MAX_SLOTS);
+        return 0;
+    }
+
+    for(token = strtok_r(list, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        slot = atoi(token);
+        if (slot < 1 || slot > MAX_SLOTS) {
+            fprintf(stderr, "Invalid slot: %s\n", token);
+            return -1;
+        }
+        slots[slot-1] = 1;
+    }
+    return 0;
+}
+
+/* Add an MCH given as <ip>[:<slots>] to the fleet */
+static int add_crate(hpm_crate_t **crates, unsigned int *nb_crates, const char *addr) {
+    hpm_crate_t *crate;
+    char *ip, *list;
+
+    crate = realloc(*crates, (*nb_crates + 1) * sizeof(hpm_crate_t));
+    if (crate == NULL || (ip = strdup(addr)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    *crates = crate;
+    crate = &crate[(*nb_crates)++];
+    memset(crate, 0, sizeof(hpm_crate_t));
+    crate->ip = ip;
+
+    list = strchr(ip, ':');
+    if (list == NULL) return 0;     //Slots given by --slot
+
+    *list++ = '\0';
+    return parse_slots(list, crate->slots);
+}
+
+/* Fleet file: one <ip>[:<slots>] per line, '#' starts a comment */
+static int read_fleet(const char *filename, hpm_crate_t **crates, unsigned int *nb_crates) {
+    FILE *f;
+    char line[256], *addr;
+    int ret = 0;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return -1;
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        addr = strtok(line, " \t\r\n");
+        if (addr == NULL || addr[0] == '#') continue;
+        ret = add_crate(crates, nb_crates, addr);
+    }
+
+    fclose(f);
+    return ret;
+}
+
 void print_usage (void) {
     fprintf (stderr, "HPMDownloader\n");
     fprintf (stderr, "Formats a binary/hex file into the HPM format and sends using IPMI to the target MCH\n");
@@ -31,17 +95,27 @@ void print_usage (void) {
              "  -c  --component                  Select the target component:\n"
              "                                       [0]-Bootloader [1]-IPMC [2]-Payload\n"
              "  --ignore-component-check         Ignore the check of the target component value\n"
+             "  --ignore-hex-checksum            Accept .hex records whose checksum is wrong\n"
              "  -n  --iana                       IANA Manufacturer Code (defaults to 0x315A)\n"
              "  -i  --id                         Product ID (defaults to 0)\n"
              "  --early_major                    Earliest compatible major version (defaults to 0)\n"
              "  --early_minor                    Earliest compatible minor version (defaults to 0)\n"
              "  -j  --new_major                  New major version (defaults to 1)\n"
              "  -m  --new_minor                  New minor version (defaults to 0)\n"
-             "  -p  --ip                         MCH IP Address\n"
+             "  -p  --ip                         MCH IP Address, may be repeated. Append :<slots> to program\n"
+             "                                       other slots than --slot behind this MCH (e.g. 10.0.0.1:1,2)\n"
+             "  --fleet                          File listing the MCHs, one <ip>[:<slots>] per line\n"
              "  -u  --username                   MCH Username (defaults to \"\")\n"
              "  -w  --password                   MCH Password (defaults to \"\")\n"
              "  -s  --slot                       Slots to be updated (separated by comma):\n"
              "                                       [1 - 12], [all]\n"
+             "  --parallel                       Program all selected slots of an MCH concurrently (over one session)\n"
+             "  --max-concurrent                 Slots programmed at the same time over all MCHs (defaults to no limit)\n"
+             "  --max-per-mch                    Slots programmed at the same time behind one MCH\n"
+             "                                       (defaults to 1, or no limit with --parallel)\n"
+             "  --shared-socket                  Talk to all the MCHs over a single UDP socket\n"
+             "  --window                         Firmware blocks kept in flight during upload (defaults to 1, max 32)\n"
+             "  --block-size                     Firmware bytes per block [1 - 64], [auto] (defaults to auto)\n"
              "  file                             Filename (including relative or absolute path)\n"
         );
     exit(EXIT_FAILURE);
@@ -58,42 +132,52 @@ int main(int argc,char **argv) {
     unsigned char new_minor;
     unsigned int component;
     bool check_component = true;
+    bool check_hex = true;
     bool retries = true;
-
-    unsigned char *ip = NULL;
+    bool concurrent = false;
+    bool shared_socket = false;
+    unsigned int window = 1;
+    unsigned char block_size = 0;    /* Negotiated with each target */
+
+    hpm_crate_t *crates = NULL;
+    unsigned int nb_crates = 0;
+    int max_concurrent = 0;
+    int max_per_mch = -1;
     unsigned char *username = "";
     unsigned char *password = "";
     unsigned char slots[12] = {0};
 
     /** HEX2BIN variables */
-    unsigned int firstAddr, lastAddr;
-    unsigned char *binary;
+    hex_image_t fw;
+    int loaded = -1;
 
     /** HPM image variables */
-    unsigned char *hpmImg;
-    unsigned int hpmImgSize;
+    hpm_image_t hpmImg;
 
     /** HPM upgrade variable */
-    unsigned int update_results[12] = {0};
+    hpm_options_t opt;
 
     /** General variables */
-    unsigned int i;
-    FILE *hpm_fd;
-    FILE * fileptr;
+    unsigned int i, mch;
     unsigned char *filename;
-    unsigned int binsize;
 
-    unsigned char iana_ascii[25], prodid_ascii[25], earliest_maj_ascii[25], earliest_min_ascii[25], new_maj_ascii[25], new_min_ascii[25];
     unsigned int iana_int, prodid_int, earliest_maj_int, earliest_min_int, new_maj_int, new_min_int;
-    unsigned char slot_inp[128];
-    unsigned int uc, comp;
 
-    char *token, ch, *endptr;
+    char ch, *endptr;
     int c;
+    long n;
 
     enum {
         early_major,
-        early_minor
+        early_minor,
+        parallel,
+        fleet,
+        concurrency,
+        per_mch,
+        shared,
+        window_size,
+        block,
+        no_hex_checksum
     };
 
     /* Default values */
@@ -127,6 +211,14 @@ int main(int argc,char **argv) {
             {"username",            required_argument,   NULL, 'u'},
             {"password",            required_argument,   NULL, 'w'},
             {"slot",                required_argument,   NULL, 's'},
+            {"parallel",            no_argument,         NULL, parallel},
+            {"fleet",               required_argument,   NULL, fleet},
+            {"max-concurrent",      required_argument,   NULL, concurrency},
+            {"max-per-mch",         required_argument,   NULL, per_mch},
+            {"shared-socket",       no_argument,         NULL, shared},
+            {"window",              required_argument,   NULL, window_size},
+            {"block-size",          required_argument,   NULL, block},
+            {"ignore-hex-checksum", no_argument,         NULL, no_hex_checksum},
             {0,0,0,0}
         };
 
@@ -150,6 +242,10 @@ int main(int argc,char **argv) {
             check_component = false;
             break;
 
+        case no_hex_checksum:
+            check_hex = false;
+            break;
+
         case 'n':
             if(strstr(optarg,"x")) {
                 sscanf(optarg, "%x",&iana_int);
@@ -211,7 +307,7 @@ int main(int argc,char **argv) {
             break;
 
         case 'p':
-            ip = optarg;
+            if (add_crate(&crates, &nb_crates, optarg) < 0) return -1;
             break;
 
         case 'u':
@@ -223,14 +319,46 @@ int main(int argc,char **argv) {
             break;
 
         case 's':
-            if(!strcmp(optarg, "all")){
-                memset(slots, 1, 12);
+            if (parse_slots(optarg, slots) < 0) return -1;
+            break;
+
+        case parallel:
+            concurrent = true;
+            break;
+
+        case fleet:
+            if (read_fleet(optarg, &crates, &nb_crates) < 0) return -1;
+            break;
+
+        case concurrency:
+            max_concurrent = strtol(optarg, &endptr, 0);
+            if (max_concurrent < 0) max_concurrent = 0;
+            break;
+
+        case per_mch:
+            max_per_mch = strtol(optarg, &endptr, 0);
+            if (max_per_mch < 0) max_per_mch = 0;
+            break;
+
+        case shared:
+            shared_socket = true;
+            break;
+
+        case window_size:
+            n = strtol(optarg, &endptr, 0);
+            if (n < 1) n = 1;
+            if (n > MAX_WINDOW) n = MAX_WINDOW;
+            window = n;
+            break;
+
+        case block:
+            if(!strcmp(optarg, "auto")){
+                block_size = 0; /* Negotiated with each target */
             } else {
-                token = strtok(optarg, ",");
-                while( token != NULL ) {
-                    slots[atoi(token)-1] = 1;
-                    token = strtok(NULL, ",");
-                }
+                c = strtol(optarg, &endptr, 0);
+                if (c < 1) c = 1;
+                if (c > MAX_DATA_PER_BLOCK) c = MAX_DATA_PER_BLOCK;
+                block_size = c;
             }
             break;
 
@@ -245,57 +373,83 @@ int main(int argc,char **argv) {
         return -1;
     }
 
+    if (nb_crates == 0) {
+        printf("No MCH address given!\n");
+        return -1;
+    }
+
+    //MCHs listed without their own slots program those of --slot
+    for(i=0; i < nb_crates; i++) {
+        if (memchr(crates[i].slots, 1, MAX_SLOTS) == NULL) {
+            memcpy(crates[i].slots, slots, MAX_SLOTS);
+        }
+    }
+
     filename = (argv[optind]);
 
     if (strcmp(getExt(filename),".bin") == 0) {
         printf("Binary File found: %s\n", filename );
-
-        fileptr = fopen(filename, "rb");      // Open the file in binary mode
-        fseek(fileptr, 0, SEEK_END);          // Jump to the end of the file
-        binsize = ftell(fileptr);             // Get the current byte offset in the file
-        rewind(fileptr);                      // Jump back to the beginning of the file
-
-        binary = (unsigned char *)malloc((binsize+1)*sizeof(unsigned char)); // Enough memory for file + \0
-        fread(binary, binsize, 1, fileptr); // Read in the entire file
-        fclose(fileptr); // Close the file
-        firstAddr = 0;
-        lastAddr = binsize;
+        loaded = hex_load_bin((const char *)filename, &fw);
     } else if (strcmp(getExt(filename),".hex") == 0) {
-        /** Translation from .hex (intel) to .bin */
-        binary = get_binary(filename, &firstAddr, &lastAddr);
+        /** Translation from .hex (intel): only the data is kept, gaps are padded in the HPM image */
+        loaded = hex_load((const char *)filename, &fw, check_hex);
     }
 
-    if (binary == NULL) {
+    if (loaded < 0) {
         return -1;
     }
 
-    /** Creation of the HPM file here */
-    hpmImg = hpm_parse(binary, (lastAddr - firstAddr), &hpmImgSize, iana, product_id, earliest_major, earliest_min, new_major, new_minor, component);
-    free(binary);
-
-    if(hpmImg == NULL) {
+    /** Creation of the HPM image here: a view on fw, which shall be kept until the download ends */
+    if(hpm_build(&hpmImg, &fw, iana, product_id, earliest_major, earliest_min, new_major, new_minor, component) < 0) {
+        hex_free(&fw);
         return -2;
     }
 
 #ifdef HPM_EXPORT
     /* Export HPM image to file */
-    hpm_fd = fopen("img.hpm", "wb");
-    fwrite(hpmImg, hpmImgSize, 1, hpm_fd);
-    fclose(hpm_fd);
+    {
+        FILE *hpm_fd = fopen("img.hpm", "wb");
+        unsigned char chunk[4096];
+        unsigned int pos, n;
+
+        for (pos = 0; pos < hpmImg.size; pos += n) {
+            n = (hpmImg.size - pos < sizeof(chunk)) ? hpmImg.size - pos : sizeof(chunk);
+            hpm_read(&hpmImg, pos, chunk, n);
+            fwrite(chunk, n, 1, hpm_fd);
+        }
+        fclose(hpm_fd);
+    }
 #endif
 
-    /** Download the image */
-    for(i=0; i<12; i++) {
-        if( slots[i] ) {
-            update_results[i] = hpmdownload(hpmImg, hpmImgSize, ip, username, password, (i+1), component, retries, check_component);
-        }
+    /** Download the image, built once for the whole fleet */
+    if (max_per_mch < 0) {
+        max_per_mch = concurrent ? 0 : 1;
     }
+
+    opt.retries = retries;
+    opt.window = window;
+    opt.block_size = block_size;
+    opt.max_concurrent = max_concurrent;
+    opt.max_per_mch = max_per_mch;
+    opt.shared_socket = shared_socket;
+    //One progress line only makes sense for one slot at a time
+    opt.progress = (max_concurrent == 1) || (nb_crates == 1 && max_per_mch == 1);
+
+    hpmdownload(&hpmImg, crates, nb_crates, username, password, check_component, &opt);
+    hex_free(&fw);
+
     int ret = 0;
     /** Print results */
-    for(i=0; i < 12; i++){
-        if(slots[i] && update_results[i]){
-            printf(RED "AMC slot %d : Programming failed \n" RESET, i+1);
-            ret = 1;
+    for(mch=0; mch < nb_crates; mch++){
+        for(i=0; i < MAX_SLOTS; i++){
+            if(crates[mch].slots[i] && crates[mch].results[i]){
+                if (nb_crates > 1) {
+                    printf(RED "MCH %s AMC slot %d : Programming failed \n" RESET, crates[mch].ip, i+1);
+                } else {
+                    printf(RED "AMC slot %d : Programming failed \n" RESET, i+1);
+                }
+                ret = 1;
+            }
         }
     }
 